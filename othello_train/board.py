@@ -10,7 +10,9 @@ BOARD_SIZE = 8
 BOARD_AREA = 64
 MOVE_PASS = BOARD_AREA
 MOVE_RECORD_SIZE = 24
-move_record_dtype = np.dtype([('board', 'B', (16,)), ('turn', 'B'), ('move', 'B'), ('game_result', 'b'), ('n_legal_moves', 'B'), ('pad', 'B', (4,))])
+move_record_dtype = np.dtype([('board', 'B', (16,)), ('turn', 'B'), ('move', 'B'), ('game_result', 'b'), ('n_legal_moves', 'B'), ('flags', 'B'), ('pad', 'B', (3,))])
+# 指し手を軽い探索(playout cap randomization)で決めた局面。方策の教師には使わない。
+RECORD_FLAG_FAST_SEARCH = 1
 
 def get_board_array(packed):
     # packed: uint8 len=16
@@ -1,66 +1,135 @@
 """
-C++ソースファイルに学習済みのDNN重みを埋め込む
+C++ソースファイルに学習済みのDNNを埋め込む
 
-重みをbase64にしたものと、構造体定義を出力する。
+モデルの構造と重みをモデル記述(形式はsrc/dnn_model.hpp)にまとめ、base64にしてヘッダファイルに出力する。
+BatchNormalizationは直前の畳み込み・全結合に統合する。
+評価器(DNNEvaluatorEmbed)は読み込み時に形状を見て実装を選ぶので、モデルの構造やチャンネル数を変えてもC++側の変更は不要。
 
-構造体定義はstdoutに出力されるので、
-/src/dnn_evaluator_embed.hpp
-の class DNNWeight 内にコピーする。
+python -m othello_train.embed_weight model/cp_26 src/_dnn_weight.hpp --model OthelloModelV1 --model_kwargs '{"ch": 16}'
 """
 
 import argparse
 import base64
-import re
+import struct
 import numpy as np
-import tensorflow as tf
 
+from othello_train.model_v1 import build_model, OthelloModelV1, OthelloModelResNetV1
+from othello_train.feat_v1 import INPUT_SHAPE
+
+# src/dnn_model.hppの定数と合わせる
+DNN_MODEL_MAGIC = 0x5748544F
+DNN_MODEL_VERSION = 1
+DNN_DTYPE_FLOAT32 = 0
+DNN_DTYPE_BFLOAT16 = 1
+DNN_DTYPE_INT8 = 2
+DTYPES = {"float32": DNN_DTYPE_FLOAT32, "bfloat16": DNN_DTYPE_BFLOAT16, "int8": DNN_DTYPE_INT8}
+DNN_LAYER_CONV2D = 1
+DNN_LAYER_DENSE = 2
+DNN_LAYER_BOARD_BIAS = 3
+
+
+class ModelDescBuilder:
+    """
+    モデル記述の層を順に追加する。テンソルの番号は0が入力、i + 1がi番目の層の出力。
+    """
+
+    def __init__(self):
+        self.layers = []
+
+    def _add(self, layer_type, input, residual, relu, ksize, in_c, out_c, kernel, bias):
+        self.layers.append((layer_type, input, residual, int(relu), ksize, in_c, out_c,
+                            np.asarray(kernel, dtype=np.float32), np.asarray(bias, dtype=np.float32)))
+        return len(self.layers)
+
+    def conv2d(self, input, kernel, bias, relu, residual=-1):
+        ksize, _, in_c, out_c = kernel.shape
+        return self._add(DNN_LAYER_CONV2D, input, residual, relu, ksize, in_c, out_c, kernel, bias)
+
+    def dense(self, input, kernel, bias, relu):
+        in_c, out_c = kernel.shape
+        return self._add(DNN_LAYER_DENSE, input, -1, relu, 0, in_c, out_c, kernel, bias)
+
+    def board_bias(self, input, bias):
+        ch = bias.shape[-1]
+        return self._add(DNN_LAYER_BOARD_BIAS, input, -1, False, 0, ch, ch, bias, np.zeros((0,), dtype=np.float32))
+
+    def to_bytes(self, policy_output, value_output, dtype):
+        data = struct.pack("<6i", DNN_MODEL_MAGIC, DNN_MODEL_VERSION, len(self.layers), policy_output, value_output, dtype)
+        for layer in self.layers:
+            data += struct.pack("<7i", *layer[:7])
+            kernel, bias = layer[7:]
+            if dtype == DNN_DTYPE_INT8 and is_int8_layer(layer):
+                scales, quantized = quantize_int8(kernel)
+                data += scales.astype("<f4").tobytes() + quantized.tobytes() + bias.astype("<f4").tobytes()
+            else:
+                for array in (kernel, bias):
+                    # int8でも、int8で計算しない層はfloat32
+                    if dtype == DNN_DTYPE_BFLOAT16:
+                        data += to_bfloat16(array).astype("<u2").tobytes()
+                    else:
+                        data += array.astype("<f4").tobytes()
+        return data
+
+
+def merge_bn(kernel, bias, bn):
+    """
+    BatchNormalizationを直前の畳み込み・全結合の重みに統合する。出力チャンネルは最後の軸。
+    """
+    gamma, beta, moving_mean, moving_variance = bn.get_weights()
+    inv_std = 1.0 / np.sqrt(moving_variance + bn.epsilon)
+    merged_kernel = kernel * inv_std * gamma
+    merged_bias = (bias - moving_mean) * inv_std * gamma + beta
+    return merged_kernel, merged_bias
 
-def model_to_weight_dict(savedmodel_dir):
-    model = tf.keras.models.load_model(savedmodel_dir)
-    prefix = "othello_model_v1/"
-    suffix = ":0"
 
-    weight_dict = {}
-    for w in model.weights:
-        name = w.name
-        name = name.removeprefix(prefix)
-        name = name.removesuffix(suffix)
-        array = w.numpy()
-        weight_dict[name] = array
+def kernel_and_bias(layer):
+    weights = layer.get_weights()
+    kernel = weights[0]
+    bias = weights[1] if len(weights) > 1 else np.zeros((kernel.shape[-1],), dtype=np.float32)
+    return kernel, bias
 
-    return weight_dict
 
+def export_model_v1(model, builder):
+    def conv_bn(x, conv_bn_layer):
+        kernel, bias = merge_bn(*kernel_and_bias(conv_bn_layer.conv), conv_bn_layer.bn)
+        return builder.conv2d(x, kernel, bias, relu=True)
 
-def merge_bn_to_conv(weight_dict, prefix_conv, prefix_bn):
-    gamma = weight_dict.pop(prefix_bn+"/gamma")
-    beta = weight_dict.pop(prefix_bn+"/beta")
-    moving_mean = weight_dict.pop(prefix_bn+"/moving_mean")
-    moving_variance = weight_dict.pop(prefix_bn+"/moving_variance")
-    kernel = weight_dict.pop(prefix_conv + "/kernel")
-    bias = weight_dict.pop(prefix_conv + "/bias")
-    inv_std = 1.0 / np.sqrt(moving_variance + 0.001)
-    merged_kernel = kernel * inv_std * gamma
-    merged_bias = (bias - moving_mean) * inv_std * gamma + beta
-    weight_dict[prefix_conv + "/kernel"] = merged_kernel
-    weight_dict[prefix_conv + "/bias"] = merged_bias
-
-
-def merge_bn_to_conv_all(weight_dict):
-    # xxx/batch_normalization(.*)/gamma などを xxx/conv2d(.*)/kernel などに統合したい
-    prefix_to_bn = {}
-    prefix_to_conv = {}
-    for name in weight_dict.keys():
-        m = re.match("^((.+)/batch_normalization(.*))/(.+)$", name)
-        if m is not None:
-            # "conv_bn_1" = "conv_bn_1/batch_normalization_1"
-            prefix_to_bn[m.group(2)] = m.group(1)
-        m = re.match("^((.+)/conv2d(.*))/(.+)$", name)
-        if m is not None:
-            # "conv_bn_1" = "conv_bn_1/conv2d_2"
-            prefix_to_conv[m.group(2)] = m.group(1)
-    for common_prefix, prefix_bn in prefix_to_bn.items():
-        prefix_conv = prefix_to_conv[common_prefix]
-        merge_bn_to_conv(weight_dict, prefix_conv, prefix_bn)
+    h = 0
+    for layer in [model.conv1, model.conv2, model.conv3, model.conv4, model.conv5, model.conv6, model.conv7]:
+        h = conv_bn(h, layer)
+    p = conv_bn(h, model.policy_conv_1)
+    p = builder.conv2d(p, *kernel_and_bias(model.policy_conv_2), relu=False)
+    v = conv_bn(h, model.value_conv_1)
+    v = builder.dense(v, *kernel_and_bias(model.value_fc_1), relu=False)
+    return p, v
+
+
+def export_model_resnet_v1(model, builder):
+    h = builder.conv2d(0, *merge_bn(*kernel_and_bias(model.conv1), model.bn1), relu=True)
+    for block in model.blocks.layers:
+        x = h
+        h = builder.conv2d(x, *merge_bn(*kernel_and_bias(block.conv1), block.bn1), relu=True)
+        # 残差を足してからReLU
+        h = builder.conv2d(h, *merge_bn(*kernel_and_bias(block.conv2), block.bn2), relu=True, residual=x)
+
+    p = builder.conv2d(h, *kernel_and_bias(model.p_conv_1), relu=False)
+    p = builder.board_bias(p, model.p_bias_1.get_weights()[0])
+
+    v = builder.conv2d(h, *merge_bn(*kernel_and_bias(model.v_conv_1), model.v_bn_1), relu=True)
+    v = builder.dense(v, *merge_bn(*kernel_and_bias(model.v_fc_2), model.v_bn_2), relu=True)
+    v = builder.dense(v, *kernel_and_bias(model.v_fc_3), relu=False)
+    return p, v
+
+
+def model_to_desc(model, dtype):
+    builder = ModelDescBuilder()
+    if isinstance(model, OthelloModelV1):
+        policy_output, value_output = export_model_v1(model, builder)
+    elif isinstance(model, OthelloModelResNetV1):
+        policy_output, value_output = export_model_resnet_v1(model, builder)
+    else:
+        raise ValueError(f"unsupported model: {type(model).__name__}")
+    return builder.to_bytes(policy_output, value_output, dtype)
 
 
 def to_bfloat16(array):
@@ -73,37 +142,52 @@ def to_bfloat16(array):
     # return ((u32) >> 16).astype(np.uint16)
 
 
-def to_bfloat16_all(weight_dict):
-    for name in weight_dict.keys():
-        weight_dict[name] = to_bfloat16(weight_dict[name])
+def is_int8_layer(layer):
+    """
+    int8の重みで出力する層か(src/dnn_model.hppのDNNLayerDesc::int8_weightと合わせる)。
+    int8の評価器がint8で計算しうる、量子化した入力を読む、ReLUを適用し残差接続のない、出力チャンネル数が8の倍数の畳み込みに限る。
+    """
+    layer_type, input, residual, relu, _, _, out_c = layer[:7]
+    return layer_type == DNN_LAYER_CONV2D and input > 0 and relu and residual < 0 and out_c % 8 == 0
 
 
-def embed_weight(weight_dict):
-    struct_def = ""
-    flat_binary = b""
-    for name, array in weight_dict.items():
-        name = name.replace("/", "_")
-        size = array.size
-        struct_def += f"float {name}[{size}];\n"
-        flat_binary += array.tobytes()
-    return struct_def, flat_binary
+def quantize_int8(kernel):
+    """
+    畳み込みの重みを出力チャンネル(最後の軸)ごとに、絶対値の最大が127になるようint8にする(dnn_conv_int8.hppのquantize_weightsと同じ)。
+    量子化の刻みとint8の重みを返す。
+    """
+    out_c = kernel.shape[-1]
+    flat = kernel.astype(np.float32).reshape(-1, out_c)
+    abs_max = np.abs(flat).max(axis=0)
+    scales = np.where(abs_max > 0, abs_max / 127.0, 1.0).astype(np.float32)
+    quantized = np.clip(np.rint(flat / scales), -127, 127).astype(np.int8)
+    return scales, quantized
 
 
 def main():
     parser = argparse.ArgumentParser()
-    parser.add_argument("savedmodel_dir")
+    parser.add_argument("src_checkpoint")
     parser.add_argument("dst_hpp")
+    parser.add_argument("--model", required=True)
+    parser.add_argument("--model_kwargs")
+    parser.add_argument("--dtype", choices=list(DTYPES.keys()), default="bfloat16",
+                        help="重みの型。int8は主な畳み込みの重みがbfloat16の半分の大きさになり、DNNEvaluatorEmbedInt8と組み合わせて使う")
+    parser.add_argument("--dst_bin", help="モデル記述をバイナリファイルにも出力する(DNNModelDesc::load_fileで読める)")
     args = parser.parse_args()
 
-    weight_dict = model_to_weight_dict(args.savedmodel_dir)
-    merge_bn_to_conv_all(weight_dict)
-    to_bfloat16_all(weight_dict)
-    struct_def, flat_binary = embed_weight(weight_dict)
+    model = build_model(args.model, args.model_kwargs)
+    model.load_weights(args.src_checkpoint)
+    empty_feats = np.zeros((4, ) + INPUT_SHAPE, dtype=np.float32)
+    model(empty_feats, training=False)
 
-    print(struct_def)
+    desc = model_to_desc(model, DTYPES[args.dtype])
+    print(f"model description: {len(desc)} bytes")
+    if args.dst_bin:
+        with open(args.dst_bin, "wb") as f:
+            f.write(desc)
     hpp_src = f"""#ifndef _DNN_WEIGHT_
 #define _DNN_WEIGHT_
-const char dnn_weight_base64[] = "{base64.b64encode(flat_binary).decode("ascii")}";
+const char dnn_weight_base64[] = "{base64.b64encode(desc).decode("ascii")}";
 #endif
 """
     with open(args.dst_hpp, "w", encoding="utf-8") as f:
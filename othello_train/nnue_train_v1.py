@@ -0,0 +1,151 @@
+"""
+NNUE形式の評価器(src/dnn_evaluator_nnue.hpp)の学習
+
+棋譜(MoveRecord形式)から学習し、DNNEvaluatorNNUEが読み込む重みファイルを出力する。
+重みファイルは、各層の重み(kernelはDenseと同じ(入力, 出力)の並び)とバイアスをfloat32で層の順に並べたもの。
+
+python -m othello_train.nnue_train_v1 dataset/selfplay.bin model/nnue.bin
+"""
+
+import argparse
+import numpy as np
+import tensorflow as tf
+from tensorflow.keras.layers import Dense
+from tensorflow.keras import Model
+
+from othello_train import board
+from othello_train.rl_train_v1 import weighted_policy_loss
+
+# dnn_evaluator_nnue.hppの定数と合わせる
+N_FEATURES = board.BOARD_AREA * 2
+HIDDEN1 = 128
+HIDDEN2 = 32
+HIDDEN3 = 32
+
+
+def clipped_relu(x):
+    # 推論側では活性を0〜1の固定小数点で持つので、範囲を揃える
+    return tf.clip_by_value(x, 0.0, 1.0)
+
+
+class OthelloNNUEModelV1(Model):
+    def __init__(self):
+        super().__init__()
+        self.fc1 = Dense(HIDDEN1, activation=None)
+        self.fc2 = Dense(HIDDEN2, activation=None)
+        self.fc3 = Dense(HIDDEN3, activation=None)
+        self.value_fc = Dense(1, activation=None)
+        self.policy_fc = Dense(board.BOARD_AREA, activation=None)
+
+    def call(self, x):
+        h = clipped_relu(self.fc1(x))
+        h = clipped_relu(self.fc2(h))
+        h = clipped_relu(self.fc3(h))
+        return self.policy_fc(h), self.value_fc(h)
+
+    def layers_in_file_order(self):
+        return [self.fc1, self.fc2, self.fc3, self.value_fc, self.policy_fc]
+
+
+def encode_records(records):
+    """
+    特徴量(手番側の石64マス, 相手の石64マス)、指し手、勝敗(勝ち=1,負け=-1,引き分け=0)、方策の損失の重みを、全局面まとめて作る
+    """
+    planes = np.unpackbits(records["board"], axis=1, bitorder="little").reshape(-1, board.N_PLAYER, board.BOARD_AREA)
+    white = records["turn"] == board.WHITE
+    planes[white] = planes[white][:, ::-1]
+    feats = planes.reshape(-1, N_FEATURES).astype(np.float32)
+    moves = records["move"].astype(np.int32)
+    game_results = np.clip(records["game_result"], -1, 1).astype(np.float32)[:, np.newaxis]
+    # 軽い探索で指した手は方策の教師として使わない(勝敗は価値の教師として使う)
+    policy_weights = ((records["flags"] & board.RECORD_FLAG_FAST_SEARCH) == 0).astype(np.float32)
+    return feats, moves, game_results, policy_weights
+
+
+def load_dataset(paths, batch_size, train_ratio=0.9):
+    records = np.concatenate([np.fromfile(path, dtype=board.move_record_dtype) for path in paths])
+    # 合法手が1個の場合を除く(rl_train_v1と同じ)
+    records = records[records["n_legal_moves"] >= 2]
+    np.random.shuffle(records)
+    border = int(train_ratio * len(records))
+    datasets = []
+    for part in (records[:border], records[border:]):
+        ds = tf.data.Dataset.from_tensor_slices(encode_records(part))
+        datasets.append(ds.shuffle(min(len(part), 100000)).batch(batch_size))
+    return datasets
+
+
+def export_weights(model, path):
+    arrays = []
+    for layer in model.layers_in_file_order():
+        kernel, bias = layer.get_weights()
+        arrays.append(kernel.astype(np.float32).ravel())
+        arrays.append(bias.astype(np.float32).ravel())
+    np.concatenate(arrays).tofile(path)
+
+
+def run_train(args):
+    model = OthelloNNUEModelV1()
+    model.build((None, N_FEATURES))
+    train_dataset, val_dataset = load_dataset(args.records, args.batch_size)
+
+    optimizer = tf.keras.optimizers.Adam(learning_rate=args.lr)
+    policy_loss_object = tf.keras.losses.SparseCategoricalCrossentropy(
+        from_logits=True, reduction=tf.keras.losses.Reduction.NONE)
+    value_loss_object = tf.keras.losses.MeanSquaredError()
+
+    def compute_loss(feats, moves, game_results, policy_weights, training):
+        predictions_policy, predictions_value = model(feats, training=training)
+        policy_loss = weighted_policy_loss(policy_loss_object, moves, predictions_policy, policy_weights)
+        value_loss = value_loss_object(game_results, tf.nn.tanh(predictions_value))
+        return policy_loss * 0.5 + value_loss, policy_loss, value_loss
+
+    @tf.function
+    def train_step(feats, moves, game_results, policy_weights):
+        with tf.GradientTape() as tape:
+            loss, policy_loss, value_loss = compute_loss(feats, moves, game_results, policy_weights, True)
+        gradients = tape.gradient(loss, model.trainable_variables)
+        optimizer.apply_gradients(zip(gradients, model.trainable_variables))
+        return loss, policy_loss, value_loss
+
+    @tf.function
+    def val_step(feats, moves, game_results, policy_weights):
+        return compute_loss(feats, moves, game_results, policy_weights, False)
+
+    for epoch in range(args.epoch):
+        results = {}
+        for name, dataset, step in (("train", train_dataset, train_step), ("val", val_dataset, val_step)):
+            metrics = [tf.keras.metrics.Mean() for _ in range(3)]
+            for feats, moves, game_results, policy_weights in dataset:
+                for metric, value in zip(metrics, step(feats, moves, game_results, policy_weights)):
+                    metric(value)
+            results[name] = [metric.result() for metric in metrics]
+        print(
+            f'Epoch {epoch + 1}, '
+            f'Loss: {results["train"][0]:.4f}, '
+            f'Policy Loss: {results["train"][1]:.4f}, '
+            f'Value Loss: {results["train"][2]:.4f}, '
+            f'Val Loss: {results["val"][0]:.4f}, '
+            f'Val Policy Loss: {results["val"][1]:.4f}, '
+            f'Val Value Loss: {results["val"][2]:.4f}'
+        )
+
+    export_weights(model, args.dst_weight)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("records", nargs="+")
+    parser.add_argument("dst_weight")
+    parser.add_argument("--epoch", type=int, default=10)
+    parser.add_argument("--batch_size", type=int, default=1024)
+    parser.add_argument("--lr", type=float, default=1e-3)
+    parser.add_argument("--device", default="/GPU:0")
+    args = parser.parse_args()
+
+    with tf.device(args.device):
+        run_train(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,7 @@
 """
 
 import argparse
+import os
 
 import numpy as np
 from tqdm import tqdm
@@ -25,15 +26,48 @@ def run(model, batch_size, games):
     while (games_completed := othello_train_cpp.games_completed()) < games:
         if pbar.n != games_completed:
             pbar.update(games_completed - pbar.n)
-        othello_train_cpp.proceed_playout(
+        # 評価が必要な局面は先頭から詰めて書き込まれる
+        n = othello_train_cpp.proceed_playout(
             batch_board_repr, batch_policy_logits, batch_value_logit)
-        predicted = model(batch_board_repr)
-        batch_policy_logits[...] = predicted[0].numpy()
-        batch_value_logit[...] = predicted[1].numpy()
+        if n == 0:
+            continue
+        predicted = model(batch_board_repr[:n])
+        batch_policy_logits[:n] = predicted[0].numpy()
+        batch_value_logit[:n] = predicted[1].numpy()
     pbar.update(games_completed - pbar.n)
     pbar.close()
 
 
+def run_pipelined(model, groups, games):
+    """
+    ゲームをgroups個のグループに分け、あるグループをモデルで評価している間に、他のグループの探索をC++側で進める。
+    """
+    buffers = []
+    for group in range(groups):
+        capacity = othello_train_cpp.playout_group_capacity(group)
+        buffers.append((np.zeros((capacity, ) + INPUT_SHAPE, dtype=np.float32),
+                        np.zeros((capacity, ) + POLICY_SHAPE, dtype=np.float32),
+                        np.zeros((capacity, ) + VALUE_SHAPE, dtype=np.float32)))
+        othello_train_cpp.submit_playout(group, *buffers[group])
+    pbar = tqdm(total=games)
+    while (games_completed := othello_train_cpp.games_completed()) < games:
+        if pbar.n != games_completed:
+            pbar.update(games_completed - pbar.n)
+        for group in range(groups):
+            board_repr, policy_logits, value_logit = buffers[group]
+            n = othello_train_cpp.collect_playout(group)
+            if n > 0:
+                predicted = model(board_repr[:n])
+                policy_logits[:n] = predicted[0].numpy()
+                value_logit[:n] = predicted[1].numpy()
+            othello_train_cpp.submit_playout(group, *buffers[group])
+    # 探索中のグループを待ってから終了する
+    for group in range(groups):
+        othello_train_cpp.collect_playout(group)
+    pbar.update(othello_train_cpp.games_completed() - pbar.n)
+    pbar.close()
+
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument("savedmodel_dir")
@@ -42,12 +76,26 @@ def main():
     parser.add_argument("--batch_size", type=int, default=256)
     parser.add_argument("--playout_limit", type=int, default=64)
     parser.add_argument("--games", type=int, default=1000)
+    parser.add_argument("--fast_playout_limit", type=int, default=16,
+                        help="軽い探索のプレイアウト回数")
+    parser.add_argument("--full_search_prob", type=float, default=1.0,
+                        help="各手でplayout_limit回の探索を行う確率。それ以外はfast_playout_limit回の軽い探索で指し、学習には使わない。")
+    parser.add_argument("--pending_per_game", type=int, default=1,
+                        help="1ゲームが同時に評価を要求する局面の最大数。batch_size // pending_per_game ゲームを並行して進める。")
+    parser.add_argument("--threads", type=int, default=os.cpu_count(),
+                        help="探索を行うスレッド数")
+    parser.add_argument("--groups", type=int, default=2,
+                        help="ゲームを分けるグループ数。2以上なら、あるグループの評価中に他のグループを探索する。")
     args = parser.parse_args()
     with tf.device(args.device):
         model = tf.keras.models.load_model(args.savedmodel_dir)
-        if othello_train_cpp.init_playout(args.records, args.batch_size, args.playout_limit) != 0:
+        parallel = args.batch_size // args.pending_per_game
+        if othello_train_cpp.init_playout(args.records, parallel, args.playout_limit, args.pending_per_game, args.threads, args.groups, args.fast_playout_limit, args.full_search_prob) != 0:
             raise RuntimeError("othello_train_cpp.init_playout failed")
-        run(model, args.batch_size, args.games)
+        if args.groups > 1:
+            run_pipelined(model, args.groups, args.games)
+        else:
+            run(model, args.batch_size, args.games)
         othello_train_cpp.end_playout()
 
 
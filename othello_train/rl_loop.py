@@ -22,6 +22,8 @@ def main():
     parser.add_argument("--games", type=int, default=10000)
     parser.add_argument("--batch_size")
     parser.add_argument("--playout_limit")
+    parser.add_argument("--fast_playout_limit")
+    parser.add_argument("--full_search_prob")
     args = parser.parse_args()
 
     work_dir = Path(args.work_dir)
@@ -46,6 +48,10 @@ def main():
             playout_args.extend(["--batch_size", args.batch_size])
         if args.playout_limit:
             playout_args.extend(["--playout_limit", args.playout_limit])
+        if args.fast_playout_limit:
+            playout_args.extend(["--fast_playout_limit", args.fast_playout_limit])
+        if args.full_search_prob:
+            playout_args.extend(["--full_search_prob", args.full_search_prob])
         check_call(playout_args, records_dir / f"records_{epoch}.bin")
         train_args = ["python", "-m", "othello_train.rl_train_v1", f"{work_dir}/cp_{epoch}/cp", f"{work_dir}/cp_{epoch+1}/cp",
                    f"{records_dir}/records_{epoch}.bin", "--epoch", f"{args.train_epoch}", "--early_stop"] + model_args
@@ -33,12 +33,16 @@ class OthelloRecordSequence(tf.keras.utils.Sequence):
         all_feats = np.zeros((cur_bs,) + INPUT_SHAPE, dtype=np.float32)  # NHWC
         all_moves = np.zeros((cur_bs,), dtype=np.int32)
         all_game_results = np.zeros((cur_bs, 1), dtype=np.float32)
+        all_policy_weights = np.zeros((cur_bs,), dtype=np.float32)
         for i in range(cur_bs):
-            f, m, g = encode_record(self.records[i+low])
+            record = self.records[i+low]
+            f, m, g = encode_record(record)
             all_feats[i] = f
             all_moves[i] = m
             all_game_results[i] = g
-        return all_feats, all_moves, all_game_results
+            # 軽い探索で指した手は方策の教師として使わない(勝敗は価値の教師として使う)
+            all_policy_weights[i] = 0.0 if record['flags'] & board.RECORD_FLAG_FAST_SEARCH else 1.0
+        return all_feats, all_moves, all_game_results, all_policy_weights
 
 
 def generate_sequence_splits(path, batch_size, train_ratio=0.9):
@@ -54,12 +58,21 @@ def generate_sequence_splits(path, batch_size, train_ratio=0.9):
 
 
 def make_loss_objects():
+    # 方策の損失は局面ごとの重みをかけて平均するため、ここでは平均しない
     policy_loss_object = tf.keras.losses.SparseCategoricalCrossentropy(
-        from_logits=True)
+        from_logits=True, reduction=tf.keras.losses.Reduction.NONE)
     value_loss_object = tf.keras.losses.MeanSquaredError()
     return policy_loss_object, value_loss_object
 
 
+def weighted_policy_loss(policy_loss_object, moves, predictions_policy, policy_weights):
+    """
+    方策の損失を、重みが0でない局面について平均する
+    """
+    losses = policy_loss_object(moves, predictions_policy)
+    return tf.reduce_sum(losses * policy_weights) / tf.maximum(tf.reduce_sum(policy_weights), 1.0)
+
+
 def make_metric_objects(name_prefix):
     train_loss = tf.keras.metrics.Mean(name=f'{name_prefix}_loss')
     train_policy_loss = tf.keras.metrics.Mean(
@@ -86,13 +99,14 @@ def run_train(args):
         'val')
 
     @tf.function
-    def train_step(images, moves, game_results):
+    def train_step(images, moves, game_results, policy_weights):
         with tf.GradientTape() as tape:
             # training=True is only needed if there are layers with different
             # behavior during training versus inference (e.g. Dropout).
             predictions_policy, predictions_value = model(
                 images, training=True)
-            policy_loss = policy_loss_object(moves, predictions_policy)
+            policy_loss = weighted_policy_loss(
+                policy_loss_object, moves, predictions_policy, policy_weights)
             value_loss = value_loss_object(
                 game_results, tf.nn.tanh(predictions_value))
             loss = policy_loss * 0.5 + value_loss  # 1:1の比率だとvalueがchance rateから動かない
@@ -101,14 +115,15 @@ def run_train(args):
         train_loss(loss)
         train_policy_loss(policy_loss)
         train_value_loss(value_loss)
-        train_policy_accuracy(moves, predictions_policy)
+        train_policy_accuracy(moves, predictions_policy, policy_weights)
 
     @tf.function
-    def val_step(images, moves, game_results):
+    def val_step(images, moves, game_results, policy_weights):
         # training=False is only needed if there are layers with different
         # behavior during training versus inference (e.g. Dropout).
         predictions_policy, predictions_value = model(images, training=False)
-        policy_loss = policy_loss_object(moves, predictions_policy)
+        policy_loss = weighted_policy_loss(
+            policy_loss_object, moves, predictions_policy, policy_weights)
         value_loss = value_loss_object(
             game_results, tf.nn.tanh(predictions_value))
         loss = policy_loss * 0.5 + value_loss
@@ -116,7 +131,7 @@ def run_train(args):
         val_loss(loss)
         val_policy_loss(policy_loss)
         val_value_loss(value_loss)
-        val_policy_accuracy(moves, predictions_policy)
+        val_policy_accuracy(moves, predictions_policy, policy_weights)
 
     last_val_loss = 10000.0
 
@@ -130,11 +145,11 @@ def run_train(args):
         val_value_loss.reset_states()
         val_policy_accuracy.reset_states()
 
-        for images, moves, game_results in tqdm(train_dataset):
-            train_step(images, moves, game_results)
+        for images, moves, game_results, policy_weights in tqdm(train_dataset):
+            train_step(images, moves, game_results, policy_weights)
 
-        for images, moves, game_results in tqdm(val_dataset):
-            val_step(images, moves, game_results)
+        for images, moves, game_results, policy_weights in tqdm(val_dataset):
+            val_step(images, moves, game_results, policy_weights)
 
         print(
             f'Epoch {epoch + 1}, '
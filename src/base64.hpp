@@ -3,65 +3,119 @@
 
 #include <vector>
 #include <cstdint>
+#include "simd_util.hpp"
 
 using namespace std;
 
-uint32_t b64ord(char c)
+// base64の文字から6bitの値への変換表。'='とbase64以外の文字は0。
+class Base64Table
 {
-    if (c == '+')
-    {
-        return 62;
-    }
-    else if (c == '/')
-    {
-        return 63;
-    }
-    else if (c >= 'A' && c <= 'Z')
+public:
+    uint8_t values[256];
+
+    constexpr Base64Table() : values()
     {
-        return c - 'A';
+        for (int i = 0; i < 26; i++)
+        {
+            values['A' + i] = i;
+            values['a' + i] = i + 26;
+        }
+        for (int i = 0; i < 10; i++)
+        {
+            values['0' + i] = i + 52;
+        }
+        values[int('+')] = 62;
+        values[int('/')] = 63;
     }
-    else if (c >= 'a' && c <= 'z')
+};
+
+constexpr Base64Table base64_table;
+
+inline uint32_t b64ord(char c)
+{
+    return base64_table.values[uint8_t(c)];
+}
+
+#ifdef SIMD_X86
+// 32文字を24バイトに変換する。文字は正しいbase64で、'='を含まないこと。
+// 文字の値は、上位4bitごとに決まる差分を足して求める('/'だけは上位4bitが'+'と同じなので別に扱う)。
+// 4文字(6bit x 4)を、maddubsとmaddで24bitにまとめ、バイト順を並べ替える。
+TARGET_AVX2 inline void b64decode_block_avx2(const char *src, uint8_t *dst)
+{
+    const __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    // 上位4bitが2('+', '/'), 3(数字), 4〜5(大文字), 6〜7(小文字)の文字に足す値
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    // '/'(0x2f)は添字が1小さくなり、16を足す
+    const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    const __m256i values = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+    // 隣接2文字を12bitに、さらに隣接2組を24bitにまとめる
+    const __m256i merged_ab = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    const __m256i merged_abcd = _mm256_madd_epi16(merged_ab, _mm256_set1_epi32(0x00011000));
+    // 32bitごとに下位3バイトを上位から並べ、128bitレーンごとの12バイトを詰める
+    const __m256i bytes = _mm256_shuffle_epi8(merged_abcd, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                                            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    const __m256i packed = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(packed));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + 16), _mm256_extracti128_si256(packed, 1));
+}
+#endif
+
+// base64の文字列(長さlenは4の倍数)を復号した長さ
+inline size_t b64decoded_size(const char *data, size_t len)
+{
+    if (len == 0)
     {
-        return c - 'a' + 26;
+        return 0;
     }
-    else if (c >= '0' && c <= '9')
+    size_t size = len / 4 * 3;
+    if (data[len - 1] == '=')
     {
-        return c - '0' + 52;
+        size -= data[len - 2] == '=' ? 2 : 1;
     }
-    return 0; // '='
+    return size;
 }
 
-vector<uint8_t> b64decode(const char *data, size_t len)
+// base64の文字列(長さlenは4の倍数)を復号し、dst(b64decoded_size(data, len)バイト)に書き込む。
+// 埋め込みの重みや定石・パターンの表など、プログラムに埋め込んだデータの展開に用いる。
+inline void b64decode(const char *data, size_t len, uint8_t *dst)
 {
     if (len == 0)
     {
-        return {};
+        return;
     }
-    size_t orig_len = len / 4 * 3;
-    vector<uint8_t> orig(orig_len);
-
-    for (size_t sofs = 0, dofs = 0; sofs < len; sofs += 4, dofs += 3)
+    const size_t size = b64decoded_size(data, len);
+    size_t sofs = 0, dofs = 0;
+#ifdef SIMD_X86
+    if (cpu_has_avx2())
+    {
+        // '='を含みうる最後の4文字は変換表で処理する
+        for (; sofs + 32 + 4 <= len; sofs += 32, dofs += 24)
+        {
+            b64decode_block_avx2(data + sofs, dst + dofs);
+        }
+    }
+#endif
+    for (; sofs < len; sofs += 4, dofs += 3)
     {
         uint32_t v = b64ord(data[sofs]);
         v = (v << 6) | b64ord(data[sofs + 1]);
         v = (v << 6) | b64ord(data[sofs + 2]);
         v = (v << 6) | b64ord(data[sofs + 3]);
-        orig[dofs] = (uint8_t)(v >> 16);
-        orig[dofs + 1] = (uint8_t)(v >> 8);
-        orig[dofs + 2] = (uint8_t)(v);
-    }
-    if (data[len - 1] == '=')
-    {
-        if (data[len - 2] == '=')
-        {
-            orig_len -= 2;
-        }
-        else
+        const uint8_t bytes[3] = {uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v)};
+        for (int i = 0; i < 3 && dofs + i < size; i++)
         {
-            orig_len -= 1;
+            dst[dofs + i] = bytes[i];
         }
     }
-    orig.resize(orig_len);
+}
+
+inline vector<uint8_t> b64decode(const char *data, size_t len)
+{
+    vector<uint8_t> orig(b64decoded_size(data, len));
+    b64decode(data, len, orig.data());
     return orig;
 }
 #endif
@@ -51,6 +51,52 @@ inline bool move_is_pass(Move move)
     return move == MOVE_PASS;
 }
 
+// 盤面の対称変換(8通り)。symのビット1=転置(a1-h8対角線で反転)、ビット2=上下反転、ビット4=左右反転。この順に適用する。
+inline BoardPlane transform_plane(BoardPlane bb, int sym)
+{
+    if (sym & 1)
+    {
+        // https://www.chessprogramming.org/Flipping_Mirroring_and_Rotating#FlipabouttheDiagonal
+        BoardPlane t;
+        t = 0x0f0f0f0f00000000ULL & (bb ^ (bb << 28));
+        bb ^= t ^ (t >> 28);
+        t = 0x3333000033330000ULL & (bb ^ (bb << 14));
+        bb ^= t ^ (t >> 14);
+        t = 0x5500550055005500ULL & (bb ^ (bb << 7));
+        bb ^= t ^ (t >> 7);
+    }
+    if (sym & 2)
+    {
+        bb = __builtin_bswap64(bb);
+    }
+    if (sym & 4)
+    {
+        bb = ((bb >> 1) & 0x5555555555555555ULL) | ((bb & 0x5555555555555555ULL) << 1);
+        bb = ((bb >> 2) & 0x3333333333333333ULL) | ((bb & 0x3333333333333333ULL) << 2);
+        bb = ((bb >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((bb & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    }
+    return bb;
+}
+
+// transform_planeと同じ変換を1マスに適用する
+inline Position transform_position(Position pos, int sym)
+{
+    int row = pos / BOARD_SIZE, col = pos % BOARD_SIZE;
+    if (sym & 1)
+    {
+        swap(row, col);
+    }
+    if (sym & 2)
+    {
+        row = BOARD_SIZE - 1 - row;
+    }
+    if (sym & 4)
+    {
+        col = BOARD_SIZE - 1 - col;
+    }
+    return row * BOARD_SIZE + col;
+}
+
 class UndoInfo
 {
 public:
@@ -10,7 +10,10 @@
 #include <array>
 #include "base64.hpp"
 #include "board.hpp"
+#include "dnn_evaluator_cached.hpp"
 #include "dnn_evaluator_embed.hpp"
+#include "dnn_evaluator_embed_int8.hpp"
+#include "dnn_evaluator_nnue.hpp"
 #include "dnn_evaluator_socket.hpp"
 #include "search_alpha_beta_constant_depth.hpp"
 #include "search_alpha_beta_iterative.hpp"
@@ -0,0 +1,475 @@
+#ifndef _DNN_CONV_
+#define _DNN_CONV_
+
+#include <vector>
+#include <stdexcept>
+#include "board.hpp"
+#include "simd_util.hpp"
+
+// 盤面上の活性は、周囲に1マスの0を加えた(PADDED_SIZE, PADDED_SIZE, ch)のNHWC形式で保持する。
+// 3x3の畳み込みで盤外を参照しても0が読まれるので、境界判定が不要になる。
+const int PADDED_SIZE = BOARD_SIZE + 2;
+const int PADDED_AREA = PADDED_SIZE * PADDED_SIZE;
+
+// 局面をまたいで通し番号を付けた画素の列のうち、begin以降のPX画素の、パディング込みの活性上での位置を求める。
+// n_pixelsを超える分は最後の画素を重複させる。SIMD実装の畳み込み(float版、int8版)で共通に用いる。
+template <int PX>
+inline void pixel_offsets(int begin, int n_pixels, int *offsets)
+{
+    for (int p = 0; p < PX; p++)
+    {
+        int q = min(begin + p, n_pixels - 1);
+        int pos = q % BOARD_AREA;
+        offsets[p] = (q / BOARD_AREA) * PADDED_AREA + (pos / BOARD_SIZE + 1) * PADDED_SIZE + (pos % BOARD_SIZE + 1);
+    }
+}
+
+#ifdef SIMD_X86
+// BoardConv2Dのパック済み重みを用いる、チャンネル数をコンパイル時に固定したAVX2実装。バイアスとReLUも同時に適用する。
+// n局面分の活性を続けて並べたバッチを、局面をまたいで通し番号を付けた画素の列として扱い、PX画素ずつ処理する。
+// 1画素の出力チャンネルをOUT_C/8個のレジスタに収め、PX画素分の累積和をすべてレジスタに置いたまま、ループを展開して積和する。
+// 読み込んだ重みはPX画素に使われ、画素のブロックが局面の境界をまたいでも端数が出ない。
+template <int KSIZE, int IN_C, int OUT_C>
+TARGET_AVX2 void board_conv2d_avx2(const float *packed_kernel, const float *packed_bias, const float *x, float *y, int n, bool relu, int, int, int)
+{
+    static_assert(OUT_C % 8 == 0, "board_conv2d_avx2 assumes OUT_C is a multiple of 8");
+    constexpr int N_VEC = OUT_C / 8;
+    constexpr int PX = N_VEC == 1 ? 12 : 6; // 累積和PX * N_VEC個と、重みN_VEC個、入力1個がレジスタ16本に収まる画素数
+    constexpr int PAD = KSIZE / 2;
+    constexpr int BLOCK_STRIDE = KSIZE * KSIZE * IN_C * 8;
+    __m256 bias[N_VEC];
+    for (int v = 0; v < N_VEC; v++)
+    {
+        bias[v] = _mm256_loadu_ps(packed_bias + v * 8);
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    const int n_pixels = n * BOARD_AREA;
+    for (int begin = 0; begin < n_pixels; begin += PX)
+    {
+        // 端数のブロックでは最後の画素を重複して計算し、書き込まない
+        int offsets[PX];
+        pixel_offsets<PX>(begin, n_pixels, offsets);
+        __m256 acc[PX][N_VEC];
+        for (int p = 0; p < PX; p++)
+        {
+            for (int v = 0; v < N_VEC; v++)
+            {
+                acc[p][v] = bias[v];
+            }
+        }
+        for (int ky = 0; ky < KSIZE; ky++)
+        {
+            for (int kx = 0; kx < KSIZE; kx++)
+            {
+                const float *xk = x + ((ky - PAD) * PADDED_SIZE + (kx - PAD)) * IN_C;
+                const float *w = packed_kernel + (ky * KSIZE + kx) * IN_C * 8;
+#pragma GCC unroll 16
+                for (int ic = 0; ic < IN_C; ic++)
+                {
+                    __m256 wv[N_VEC];
+                    for (int v = 0; v < N_VEC; v++)
+                    {
+                        wv[v] = _mm256_loadu_ps(w + v * BLOCK_STRIDE + ic * 8);
+                    }
+                    for (int p = 0; p < PX; p++)
+                    {
+                        const __m256 xv = _mm256_broadcast_ss(xk + offsets[p] * IN_C + ic);
+                        for (int v = 0; v < N_VEC; v++)
+                        {
+                            acc[p][v] = _mm256_fmadd_ps(xv, wv[v], acc[p][v]);
+                        }
+                    }
+                }
+            }
+        }
+        for (int p = 0; p < PX && begin + p < n_pixels; p++)
+        {
+            for (int v = 0; v < N_VEC; v++)
+            {
+                _mm256_storeu_ps(y + offsets[p] * OUT_C + v * 8, relu ? _mm256_max_ps(acc[p][v], zero) : acc[p][v]);
+            }
+        }
+    }
+}
+
+// board_conv2d_avx2と同じ計算を、形状を実行時に受け取って行う。特殊化していない形状(モデルの設定を変えた場合など)に用いる。
+// 出力チャンネルを8 * N_VEC個ずつのグループに分け、グループごとに画素のブロックを処理する。out_cは8 * N_VECの倍数。
+template <int N_VEC>
+TARGET_AVX2 void board_conv2d_avx2_any(const float *packed_kernel, const float *packed_bias, const float *x, float *y, int n, bool relu, int ksize, int in_c, int out_c)
+{
+    constexpr int PX = N_VEC == 1 ? 12 : 6;
+    const int pad = ksize / 2;
+    const int block_stride = ksize * ksize * in_c * 8;
+    const __m256 zero = _mm256_setzero_ps();
+    const int n_pixels = n * BOARD_AREA;
+    for (int group = 0; group < out_c / (8 * N_VEC); group++)
+    {
+        const float *group_kernel = packed_kernel + group * N_VEC * block_stride;
+        __m256 bias[N_VEC];
+        for (int v = 0; v < N_VEC; v++)
+        {
+            bias[v] = _mm256_loadu_ps(packed_bias + (group * N_VEC + v) * 8);
+        }
+        for (int begin = 0; begin < n_pixels; begin += PX)
+        {
+            int offsets[PX];
+            pixel_offsets<PX>(begin, n_pixels, offsets);
+            __m256 acc[PX][N_VEC];
+            for (int p = 0; p < PX; p++)
+            {
+                for (int v = 0; v < N_VEC; v++)
+                {
+                    acc[p][v] = bias[v];
+                }
+            }
+            for (int ky = 0; ky < ksize; ky++)
+            {
+                for (int kx = 0; kx < ksize; kx++)
+                {
+                    const float *xk = x + ((ky - pad) * PADDED_SIZE + (kx - pad)) * in_c;
+                    const float *w = group_kernel + (ky * ksize + kx) * in_c * 8;
+                    for (int ic = 0; ic < in_c; ic++)
+                    {
+                        __m256 wv[N_VEC];
+                        for (int v = 0; v < N_VEC; v++)
+                        {
+                            wv[v] = _mm256_loadu_ps(w + v * block_stride + ic * 8);
+                        }
+                        for (int p = 0; p < PX; p++)
+                        {
+                            const __m256 xv = _mm256_broadcast_ss(xk + offsets[p] * in_c + ic);
+                            for (int v = 0; v < N_VEC; v++)
+                            {
+                                acc[p][v] = _mm256_fmadd_ps(xv, wv[v], acc[p][v]);
+                            }
+                        }
+                    }
+                }
+            }
+            for (int p = 0; p < PX && begin + p < n_pixels; p++)
+            {
+                for (int v = 0; v < N_VEC; v++)
+                {
+                    _mm256_storeu_ps(y + offsets[p] * out_c + (group * N_VEC + v) * 8, relu ? _mm256_max_ps(acc[p][v], zero) : acc[p][v]);
+                }
+            }
+        }
+    }
+}
+#endif
+
+// 盤面(BOARD_SIZE x BOARD_SIZE)上の畳み込み。stride 1で、出力サイズが入力と同じになるようpaddingする。
+// 重みは構築時に出力チャンネルOC_BLOCK個ごとのブロックに並べ替え、ブロック内の出力チャンネルを連続させておく。
+// 出力1行(BOARD_SIZE画素) x OC_BLOCKチャンネルの累積和をレジスタに置き、入力1要素を読むたびにOC_BLOCK個の積和を行う。
+class BoardConv2D
+{
+public:
+    static constexpr int OC_BLOCK = 8;
+    int ksize, in_c, out_c;
+
+private:
+    int n_blocks;
+    vector<float> packed_kernel; // (n_blocks, ksize, ksize, in_c, OC_BLOCK)。out_cを超える出力チャンネルは0。
+    vector<float> packed_bias;   // (n_blocks, OC_BLOCK)
+    // 形状に特殊化したSIMD実装。該当するものがないか、CPUが対応していなければnullptrで、汎用の実装を用いる。
+    using KernelFunc = void (*)(const float *packed_kernel, const float *packed_bias, const float *x, float *y, int n, bool relu, int ksize, int in_c, int out_c);
+    KernelFunc kernel_func;
+
+    static KernelFunc select_kernel(int ksize, int in_c, int out_c)
+    {
+#ifdef SIMD_X86
+        if (cpu_has_avx2())
+        {
+            // 埋め込みモデル(チャンネル数16)で使う形状。それ以外は、出力チャンネルが8の倍数なら形状を実行時に受け取る実装を用いる。
+            if (ksize == 3 && in_c == 16 && out_c == 16)
+            {
+                return board_conv2d_avx2<3, 16, 16>;
+            }
+            if (ksize == 1 && in_c == 16 && out_c == 16)
+            {
+                return board_conv2d_avx2<1, 16, 16>;
+            }
+            if (out_c % 16 == 0)
+            {
+                return board_conv2d_avx2_any<2>;
+            }
+            if (out_c % 8 == 0)
+            {
+                return board_conv2d_avx2_any<1>;
+            }
+        }
+#endif
+        return nullptr;
+    }
+
+public:
+    BoardConv2D() : ksize(0), in_c(0), out_c(0), n_blocks(0), kernel_func(nullptr)
+    {
+    }
+
+    // kernel: (ksize, ksize, in_c, out_c) (TensorFlowのConv2Dと同じ並び)、bias: (out_c)
+    BoardConv2D(const float *kernel, const float *bias, int ksize, int in_c, int out_c)
+        : ksize(ksize), in_c(in_c), out_c(out_c), n_blocks((out_c + OC_BLOCK - 1) / OC_BLOCK), kernel_func(select_kernel(ksize, in_c, out_c))
+    {
+        if (ksize % 2 == 0 || ksize / 2 > (PADDED_SIZE - BOARD_SIZE) / 2)
+        {
+            throw runtime_error("BoardConv2D: unsupported kernel size");
+        }
+        packed_kernel.assign(n_blocks * ksize * ksize * in_c * OC_BLOCK, 0.0F);
+        packed_bias.assign(n_blocks * OC_BLOCK, 0.0F);
+        for (int oc = 0; oc < out_c; oc++)
+        {
+            int block = oc / OC_BLOCK, o = oc % OC_BLOCK;
+            packed_bias[block * OC_BLOCK + o] = bias[oc];
+            for (int k = 0; k < ksize * ksize; k++)
+            {
+                for (int ic = 0; ic < in_c; ic++)
+                {
+                    packed_kernel[((block * ksize * ksize + k) * in_c + ic) * OC_BLOCK + o] = kernel[(k * in_c + ic) * out_c + oc];
+                }
+            }
+        }
+    }
+
+    // x: (n, PADDED_SIZE, PADDED_SIZE, in_c)、y: (n, PADDED_SIZE, PADDED_SIZE, out_c)
+    // yは盤面の内側だけを書き込む。周囲の0は呼び出し側で用意しておく。reluがtrueならReLUを適用して書き込む。
+    void forward(const float *x, float *y, int n, bool relu) const
+    {
+        if (kernel_func)
+        {
+            kernel_func(packed_kernel.data(), packed_bias.data(), x, y, n, relu, ksize, in_c, out_c);
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            forward_generic(x + i * PADDED_AREA * in_c, y + i * PADDED_AREA * out_c, relu);
+        }
+    }
+
+private:
+    void forward_generic(const float *x, float *y, bool relu) const
+    {
+        const int pad = ksize / 2;
+        for (int block = 0; block < n_blocks; block++)
+        {
+            const float *w_block = &packed_kernel[block * ksize * ksize * in_c * OC_BLOCK];
+            const float *b_block = &packed_bias[block * OC_BLOCK];
+            const int oc_begin = block * OC_BLOCK;
+            const int n_oc = min(OC_BLOCK, out_c - oc_begin);
+            for (int oy = 0; oy < BOARD_SIZE; oy++)
+            {
+                float acc[BOARD_SIZE][OC_BLOCK];
+                for (int px = 0; px < BOARD_SIZE; px++)
+                {
+                    for (int o = 0; o < OC_BLOCK; o++)
+                    {
+                        acc[px][o] = b_block[o];
+                    }
+                }
+                const float *w = w_block;
+                for (int ky = 0; ky < ksize; ky++)
+                {
+                    for (int kx = 0; kx < ksize; kx++)
+                    {
+                        // 出力(oy, 0)に対応する入力の位置(パディング込みの座標)
+                        const float *x_row = x + ((oy + 1 - pad + ky) * PADDED_SIZE + (1 - pad + kx)) * in_c;
+                        for (int ic = 0; ic < in_c; ic++, w += OC_BLOCK)
+                        {
+#pragma GCC unroll 8
+                            for (int px = 0; px < BOARD_SIZE; px++)
+                            {
+                                const float xv = x_row[px * in_c + ic];
+#pragma GCC unroll 8
+                                for (int o = 0; o < OC_BLOCK; o++)
+                                {
+                                    acc[px][o] += xv * w[o];
+                                }
+                            }
+                        }
+                    }
+                }
+                float *y_row = y + ((oy + 1) * PADDED_SIZE + 1) * out_c + oc_begin;
+                for (int px = 0; px < BOARD_SIZE; px++)
+                {
+                    for (int o = 0; o < n_oc; o++)
+                    {
+                        float v = acc[px][o];
+                        y_row[px * out_c + o] = relu ? max(v, 0.0F) : v;
+                    }
+                }
+            }
+        }
+    }
+};
+
+#ifdef SIMD_X86
+// BoardInputConv2D::forward_denseのAVX2実装。出力チャンネルをOUT_C/8個のレジスタで扱う。
+template <int OUT_C>
+TARGET_AVX2 void board_input_conv2d_avx2(const float *stone_kernel, const float *base, const int *scatter_begin, const int *scatter_y, const int *scatter_w, const BoardPlane *stones, float *y)
+{
+    static_assert(OUT_C % 8 == 0, "board_input_conv2d_avx2 assumes OUT_C is a multiple of 8");
+    memcpy(y, base, BOARD_AREA * OUT_C * sizeof(float));
+    for (int c = 0; c < 2; c++)
+    {
+        for (BoardPlane bb = stones[c]; bb; bb &= bb - 1)
+        {
+            const int pos = __builtin_ctzll(bb) + c * BOARD_AREA;
+            for (int j = scatter_begin[pos]; j < scatter_begin[pos + 1]; j++)
+            {
+                float *yp = y + scatter_y[j];
+                const float *w = stone_kernel + scatter_w[j];
+                for (int v = 0; v < OUT_C; v += 8)
+                {
+                    _mm256_storeu_ps(yp + v, _mm256_add_ps(_mm256_loadu_ps(yp + v), _mm256_loadu_ps(w + v)));
+                }
+            }
+        }
+    }
+}
+#endif
+
+// 盤面を直接入力とする最初の畳み込み層。入力はFeatureExtractorと同じ3チャンネル(手番側の石、相手の石、盤内で1の定数)。
+// 入力は0か1なので、出力は「バイアス+定数チャンネルの寄与」(盤面によらず、画素ごとに構築時に求めておく)に、
+// 石のある各マスから周囲の出力画素へ、その石のチャンネルの重みを足し込んだものになる。石はBoard::planeのビットをctzで列挙する。
+// DNNInputFeatureを作らずに済み、加算も石の数 x ksize^2回で済む。
+class BoardInputConv2D
+{
+public:
+    int ksize, out_c;
+
+private:
+    vector<float> stone_kernel; // (2, ksize, ksize, out_c)。手番側、相手の石のチャンネルの重み。
+    vector<float> base;         // (BOARD_AREA, out_c)。バイアスと定数チャンネルの寄与。
+    // 石(チャンネルc、マスpos)の足し込み先。scatter_begin[c * BOARD_AREA + pos]から次の要素の手前までの各jについて、
+    // 出力のscatter_y[j]番目の要素からout_c個に、stone_kernelのscatter_w[j]番目の要素からout_c個を足す。盤外の出力画素は含まない。
+    vector<int> scatter_begin, scatter_y, scatter_w;
+    using KernelFunc = void (*)(const float *stone_kernel, const float *base, const int *scatter_begin, const int *scatter_y, const int *scatter_w, const BoardPlane *stones, float *y);
+    KernelFunc kernel_func;
+
+    static KernelFunc select_kernel(int out_c)
+    {
+#ifdef SIMD_X86
+        if (cpu_has_avx2() && out_c == 16)
+        {
+            return board_input_conv2d_avx2<16>;
+        }
+#endif
+        return nullptr;
+    }
+
+public:
+    BoardInputConv2D() : ksize(0), out_c(0), kernel_func(nullptr)
+    {
+    }
+
+    // kernel: (ksize, ksize, 3, out_c)、bias: (out_c)
+    BoardInputConv2D(const float *kernel, const float *bias, int ksize, int out_c)
+        : ksize(ksize), out_c(out_c), stone_kernel(2 * ksize * ksize * out_c), base(BOARD_AREA * out_c), kernel_func(select_kernel(out_c))
+    {
+        if (ksize % 2 == 0 || ksize / 2 > (PADDED_SIZE - BOARD_SIZE) / 2)
+        {
+            throw runtime_error("BoardInputConv2D: unsupported kernel size");
+        }
+        const int pad = ksize / 2;
+        for (int c = 0; c < 2; c++)
+        {
+            for (int k = 0; k < ksize * ksize; k++)
+            {
+                for (int oc = 0; oc < out_c; oc++)
+                {
+                    stone_kernel[(c * ksize * ksize + k) * out_c + oc] = kernel[(k * 3 + c) * out_c + oc];
+                }
+            }
+        }
+        for (int pos = 0; pos < BOARD_AREA; pos++)
+        {
+            const int oy = pos / BOARD_SIZE, ox = pos % BOARD_SIZE;
+            for (int oc = 0; oc < out_c; oc++)
+            {
+                float sum = bias[oc];
+                for (int ky = 0; ky < ksize; ky++)
+                {
+                    for (int kx = 0; kx < ksize; kx++)
+                    {
+                        const int iy = oy - pad + ky, ix = ox - pad + kx;
+                        if (iy >= 0 && iy < BOARD_SIZE && ix >= 0 && ix < BOARD_SIZE)
+                        {
+                            sum += kernel[((ky * ksize + kx) * 3 + 2) * out_c + oc];
+                        }
+                    }
+                }
+                base[pos * out_c + oc] = sum;
+            }
+        }
+        // 入力(iy, ix)は、出力(iy + pad - ky, ix + pad - kx)からカーネルの(ky, kx)の位置で参照される
+        scatter_begin.reserve(2 * BOARD_AREA + 1);
+        scatter_y.reserve(2 * BOARD_AREA * ksize * ksize);
+        scatter_w.reserve(2 * BOARD_AREA * ksize * ksize);
+        for (int c = 0; c < 2; c++)
+        {
+            for (int pos = 0; pos < BOARD_AREA; pos++)
+            {
+                scatter_begin.push_back(scatter_y.size());
+                const int iy = pos / BOARD_SIZE, ix = pos % BOARD_SIZE;
+                for (int ky = 0; ky < ksize; ky++)
+                {
+                    for (int kx = 0; kx < ksize; kx++)
+                    {
+                        const int oy = iy + pad - ky, ox = ix + pad - kx;
+                        if (oy >= 0 && oy < BOARD_SIZE && ox >= 0 && ox < BOARD_SIZE)
+                        {
+                            scatter_y.push_back((oy * BOARD_SIZE + ox) * out_c);
+                            scatter_w.push_back((c * ksize * ksize + ky * ksize + kx) * out_c);
+                        }
+                    }
+                }
+            }
+        }
+        scatter_begin.push_back(scatter_y.size());
+    }
+
+    // 活性化関数を適用する前の出力を、周囲のない(BOARD_AREA, out_c)の並びでyに書き込む
+    void forward_dense(const Board &board, float *y) const
+    {
+        const BoardPlane stones[2] = {board.plane(board.turn()), board.plane(1 - board.turn())};
+        if (kernel_func)
+        {
+            kernel_func(stone_kernel.data(), base.data(), scatter_begin.data(), scatter_y.data(), scatter_w.data(), stones, y);
+            return;
+        }
+        memcpy(y, base.data(), BOARD_AREA * out_c * sizeof(float));
+        for (int c = 0; c < 2; c++)
+        {
+            for (BoardPlane bb = stones[c]; bb; bb &= bb - 1)
+            {
+                const int pos = __builtin_ctzll(bb) + c * BOARD_AREA;
+                for (int j = scatter_begin[pos]; j < scatter_begin[pos + 1]; j++)
+                {
+                    float *yp = y + scatter_y[j];
+                    const float *w = &stone_kernel[scatter_w[j]];
+                    for (int oc = 0; oc < out_c; oc++)
+                    {
+                        yp[oc] += w[oc];
+                    }
+                }
+            }
+        }
+    }
+
+    // y: (PADDED_SIZE, PADDED_SIZE, out_c)。BoardConv2D::forwardと同じく、盤面の内側だけを書き込む。
+    // work: (BOARD_AREA, out_c)の作業領域
+    void forward(const Board &board, float *y, float *work, bool relu) const
+    {
+        forward_dense(board, work);
+        for (int row = 0; row < BOARD_SIZE; row++)
+        {
+            float *y_row = y + ((row + 1) * PADDED_SIZE + 1) * out_c;
+            const float *w_row = work + row * BOARD_SIZE * out_c;
+            for (int i = 0; i < BOARD_SIZE * out_c; i++)
+            {
+                y_row[i] = relu ? max(w_row[i], 0.0F) : w_row[i];
+            }
+        }
+    }
+};
+#endif
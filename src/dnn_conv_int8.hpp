@@ -0,0 +1,399 @@
+#ifndef _DNN_CONV_INT8_
+#define _DNN_CONV_INT8_
+
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include "dnn_conv.hpp"
+
+// 量子化した活性の最大値。AVX2のmaddubsで隣接2要素の積和(uint8 x int8)がint16で飽和しないよう、7bitに制限する。
+const int INT8_ACTIVATION_MAX = 127;
+// 量子化した重みの絶対値の最大値
+const int INT8_WEIGHT_MAX = 127;
+
+// in_cを4の倍数に切り上げる。int8の畳み込みは入力4チャンネルずつ積和するため、活性のチャンネル数をこれに揃える。
+inline int int8_channels(int in_c)
+{
+    return (in_c + 3) / 4 * 4;
+}
+
+// floatの値を、量子化の刻みscaleで0〜INT8_ACTIVATION_MAXのuint8にする。ReLUを兼ねる。
+inline uint8_t quantize_activation(float x, float scale)
+{
+    return static_cast<uint8_t>(min(max(lrintf(x / scale), 0L), long(INT8_ACTIVATION_MAX)));
+}
+
+// 重みn個を、絶対値の最大がINT8_WEIGHT_MAXになるようint8にする。量子化の刻みを返す。
+inline float quantize_weights(const float *src, int n, int8_t *dst)
+{
+    float abs_max = 0.0F;
+    for (int i = 0; i < n; i++)
+    {
+        abs_max = max(abs_max, abs(src[i]));
+    }
+    float scale = abs_max > 0.0F ? abs_max / INT8_WEIGHT_MAX : 1.0F;
+    for (int i = 0; i < n; i++)
+    {
+        dst[i] = static_cast<int8_t>(lrintf(src[i] / scale));
+    }
+    return scale;
+}
+
+#ifdef SIMD_X86
+// dot_u8i8のAVX2実装。nは32の倍数。
+TARGET_AVX2 inline int32_t dot_u8i8_avx2(const uint8_t *x, const int8_t *w, int n)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32)
+    {
+        __m256i xv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+        __m256i wv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(w + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, wv), ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+// 量子化した活性(0〜INT8_ACTIVATION_MAX)と重みの内積
+inline int32_t dot_u8i8(const uint8_t *x, const int8_t *w, int n)
+{
+#ifdef SIMD_X86
+    if (n % 32 == 0 && cpu_has_avx2())
+    {
+        return dot_u8i8_avx2(x, w, n);
+    }
+#endif
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += int32_t(x[i]) * int32_t(w[i]);
+    }
+    return sum;
+}
+
+#ifdef SIMD_X86
+// dense_u8i8のAVX2実装。in_cは32の倍数、out_cは8の倍数。
+// 8出力分の積和を別々のレジスタに累積し、最後に水平加算をまとめて行う。
+TARGET_AVX2 inline void dense_u8i8_avx2(const uint8_t *x, const int8_t *kernel, int in_c, int out_c, int32_t *y)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int o = 0; o < out_c; o += 8)
+    {
+        __m256i acc[8];
+        for (int k = 0; k < 8; k++)
+        {
+            acc[k] = _mm256_setzero_si256();
+        }
+        for (int i = 0; i < in_c; i += 32)
+        {
+            const __m256i xv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+            for (int k = 0; k < 8; k++)
+            {
+                const __m256i wv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kernel + (o + k) * in_c + i));
+                acc[k] = _mm256_add_epi32(acc[k], _mm256_madd_epi16(_mm256_maddubs_epi16(xv, wv), ones));
+            }
+        }
+        // 128bitレーンごとに、acc[0..3]、acc[4..7]の合計を並べる
+        __m256i s0123 = _mm256_hadd_epi32(_mm256_hadd_epi32(acc[0], acc[1]), _mm256_hadd_epi32(acc[2], acc[3]));
+        __m256i s4567 = _mm256_hadd_epi32(_mm256_hadd_epi32(acc[4], acc[5]), _mm256_hadd_epi32(acc[6], acc[7]));
+        __m256i sum = _mm256_add_epi32(_mm256_permute2x128_si256(s0123, s4567, 0x20), _mm256_permute2x128_si256(s0123, s4567, 0x31));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(y + o), sum);
+    }
+}
+#endif
+
+// 出力out_c個の全結合層の積和。kernelは(out_c, in_c)で、出力ごとに入力が連続する。
+inline void dense_u8i8(const uint8_t *x, const int8_t *kernel, int in_c, int out_c, int32_t *y)
+{
+#ifdef SIMD_X86
+    if (in_c % 32 == 0 && out_c % 8 == 0 && cpu_has_avx2())
+    {
+        dense_u8i8_avx2(x, kernel, in_c, out_c, y);
+        return;
+    }
+#endif
+    for (int o = 0; o < out_c; o++)
+    {
+        y[o] = dot_u8i8(x, kernel + o * in_c, in_c);
+    }
+}
+
+#ifdef SIMD_X86
+// PX画素分のint32の累積和(出力8 * N_VECチャンネル分)を、次の層の入力となるuint8に変換して書き込む。
+// 出力チャンネルcの値は acc * out_scale[c] + out_bias[c] を丸め、0〜INT8_ACTIVATION_MAXに収めたもの。
+// y, out_scale, out_biasは書き込むチャンネルの先頭を指し、y_strideは出力の画素あたりのチャンネル数。
+template <int N_VEC, int PX>
+TARGET_AVX2 inline void requantize_store_avx2(__m256i (&acc)[PX][N_VEC], const float *out_scale, const float *out_bias, uint8_t *y, int y_stride, const int *offsets, int n_valid)
+{
+    const __m128i max_value = _mm_set1_epi8(INT8_ACTIVATION_MAX);
+    for (int p = 0; p < n_valid; p++)
+    {
+        uint8_t *yp = y + offsets[p] * y_stride;
+        for (int v = 0; v < N_VEC; v += 2)
+        {
+            __m256i lo = _mm256_cvtps_epi32(_mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[p][v]), _mm256_loadu_ps(out_scale + v * 8), _mm256_loadu_ps(out_bias + v * 8)));
+            __m256i hi = lo;
+            if (v + 1 < N_VEC)
+            {
+                hi = _mm256_cvtps_epi32(_mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[p][v + 1]), _mm256_loadu_ps(out_scale + v * 8 + 8), _mm256_loadu_ps(out_bias + v * 8 + 8)));
+            }
+            // packsはレーンごとに並べるので、permuteでチャンネル順に戻す
+            __m256i packed16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i packed8 = _mm_min_epu8(_mm_packus_epi16(_mm256_castsi256_si128(packed16), _mm256_extracti128_si256(packed16, 1)), max_value);
+            if (v + 1 < N_VEC)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(yp + v * 8), packed8);
+            }
+            else
+            {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(yp + v * 8), packed8);
+            }
+        }
+    }
+}
+
+// 8bitの積和命令の違いを吸収するタグ。mac(acc, x, w)は、int32 x 8のaccの各要素に、xとwの対応する4バイト(uint8 x int8)の積和を加える。
+// AVX2にはこの命令がないので、maddubsで隣接2要素をint16に積和し、maddで隣接2要素をint32に足す。
+struct Int8MacAvx2
+{
+    TARGET_AVX2 static inline __m256i mac(__m256i acc, __m256i x, __m256i w)
+    {
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), _mm256_set1_epi16(1)));
+    }
+};
+
+// AVX-VNNIのvpdpbusdは1命令で同じ積和を行う(maddubsのint16での飽和もない)
+struct Int8MacVnni
+{
+    TARGET_AVX_VNNI static inline __m256i mac(__m256i acc, __m256i x, __m256i w)
+    {
+        return _mm256_dpbusd_avx_epi32(acc, x, w);
+    }
+};
+
+// board_conv2d_avx2(float版)と同じ画素の分け方で、入力4チャンネルずつ積和する。
+// 入力4バイトを全要素にブロードキャストし、重み(出力8チャンネル x 入力4チャンネル)とMAC::macで積和する。
+// 出力チャンネルを8 * N_VEC個ずつのグループに分け、グループごとに画素のブロックを処理する。out_cは8 * N_VECの倍数。
+// KSIZE, IN_C4, OUT_Cが0でなければ形状をコンパイル時に固定し(引数の値は無視する)、0なら実行時の引数を用いる。
+// MACの命令セットに合わせた関数(board_conv2d_int8_avx2、board_conv2d_int8_vnni)に展開して用いる。
+// MAC::macはalways_inlineにしないことで、展開先の関数でインライン化される(ここで展開しようとするとAVX-VNNIの命令が使えない)。
+template <class MAC, int N_VEC, int KSIZE, int IN_C4, int OUT_C>
+TARGET_AVX2 inline __attribute__((always_inline)) void board_conv2d_int8_kernel(const int8_t *packed_kernel, const float *out_scale, const float *out_bias, const uint8_t *x, uint8_t *y, int n, int ksize_arg, int in_c4_arg, int out_c_arg)
+{
+    static_assert(OUT_C % (8 * N_VEC) == 0 && IN_C4 % 4 == 0, "board_conv2d_int8_kernel: unsupported channels");
+    constexpr int PX = N_VEC == 1 ? 12 : 6; // 累積和PX * N_VEC個と、重みN_VEC個、入力1個、定数1個がレジスタ16本に収まる画素数
+    const int ksize = KSIZE ? KSIZE : ksize_arg;
+    const int in_c4 = IN_C4 ? IN_C4 : in_c4_arg;
+    const int out_c = OUT_C ? OUT_C : out_c_arg;
+    const int pad = ksize / 2;
+    const int n_pixels = n * BOARD_AREA;
+    for (int group_c = 0; group_c < out_c; group_c += 8 * N_VEC)
+    {
+        for (int begin = 0; begin < n_pixels; begin += PX)
+        {
+            int offsets[PX];
+            pixel_offsets<PX>(begin, n_pixels, offsets);
+            __m256i acc[PX][N_VEC];
+            for (int p = 0; p < PX; p++)
+            {
+                for (int v = 0; v < N_VEC; v++)
+                {
+                    acc[p][v] = _mm256_setzero_si256();
+                }
+            }
+            for (int ky = 0; ky < ksize; ky++)
+            {
+                for (int kx = 0; kx < ksize; kx++)
+                {
+                    const uint8_t *xk = x + ((ky - pad) * PADDED_SIZE + (kx - pad)) * in_c4;
+                    const int8_t *w = packed_kernel + (ky * ksize + kx) * in_c4 * out_c + group_c * 4;
+#pragma GCC unroll 4
+                    for (int ic = 0; ic < in_c4; ic += 4)
+                    {
+                        __m256i wv[N_VEC];
+                        for (int v = 0; v < N_VEC; v++)
+                        {
+                            wv[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(w + ic * out_c + v * 32));
+                        }
+                        for (int p = 0; p < PX; p++)
+                        {
+                            int32_t x4;
+                            memcpy(&x4, xk + offsets[p] * in_c4 + ic, sizeof(x4));
+                            const __m256i xv = _mm256_set1_epi32(x4);
+                            for (int v = 0; v < N_VEC; v++)
+                            {
+                                acc[p][v] = MAC::mac(acc[p][v], xv, wv[v]);
+                            }
+                        }
+                    }
+                }
+            }
+            requantize_store_avx2<N_VEC, PX>(acc, out_scale + group_c, out_bias + group_c, y + group_c, out_c, offsets, min(PX, n_pixels - begin));
+        }
+    }
+}
+
+template <int N_VEC, int KSIZE = 0, int IN_C4 = 0, int OUT_C = 0>
+TARGET_AVX2 void board_conv2d_int8_avx2(const int8_t *packed_kernel, const float *out_scale, const float *out_bias, const uint8_t *x, uint8_t *y, int n, int ksize, int in_c4, int out_c)
+{
+    board_conv2d_int8_kernel<Int8MacAvx2, N_VEC, KSIZE, IN_C4, OUT_C>(packed_kernel, out_scale, out_bias, x, y, n, ksize, in_c4, out_c);
+}
+
+template <int N_VEC, int KSIZE = 0, int IN_C4 = 0, int OUT_C = 0>
+TARGET_AVX_VNNI void board_conv2d_int8_vnni(const int8_t *packed_kernel, const float *out_scale, const float *out_bias, const uint8_t *x, uint8_t *y, int n, int ksize, int in_c4, int out_c)
+{
+    board_conv2d_int8_kernel<Int8MacVnni, N_VEC, KSIZE, IN_C4, OUT_C>(packed_kernel, out_scale, out_bias, x, y, n, ksize, in_c4, out_c);
+}
+#endif
+
+// 盤面上の畳み込み(BoardConv2Dと同じ形状)のint8版。ReLUを適用し、次の層の入力となる量子化済みの活性を出力する。
+// 入力: 刻みin_scaleで量子化したuint8(0〜INT8_ACTIVATION_MAX)。(n, PADDED_SIZE, PADDED_SIZE, int8_channels(in_c))で、周囲は0。
+// 重み: 出力チャンネルごとに、絶対値の最大がINT8_WEIGHT_MAXになるよう量子化したint8。
+// 出力: 刻みout_step_scaleで量子化したuint8。(n, PADDED_SIZE, PADDED_SIZE, out_c)の内側だけを書き込む。
+// 累積和はint32で行い、出力チャンネルごとの係数(入力と重みの刻みの積 / 出力の刻み)とバイアスで出力の刻みに変換する。
+class BoardConv2DInt8
+{
+public:
+    int ksize, in_c, in_c4, out_c;
+
+private:
+    vector<int8_t> packed_kernel; // (ksize, ksize, in_c4 / 4, out_c, 4)。出力チャンネルごとに連続する入力4チャンネルをまとめる。
+    vector<float> out_scale;      // (out_c)
+    vector<float> out_bias;       // (out_c)
+    using KernelFunc = void (*)(const int8_t *packed_kernel, const float *out_scale, const float *out_bias, const uint8_t *x, uint8_t *y, int n, int ksize, int in_c4, int out_c);
+    KernelFunc kernel_func;
+
+    // 埋め込みモデル(チャンネル数16)で使う形状は特殊化した実装、それ以外は出力チャンネルが8の倍数なら形状を実行時に受け取る実装を用いる
+    static KernelFunc select_kernel(int ksize, int in_c4, int out_c)
+    {
+#ifdef SIMD_X86
+        if (cpu_has_avx_vnni())
+        {
+            if (ksize == 3 && in_c4 == 16 && out_c == 16)
+            {
+                return board_conv2d_int8_vnni<2, 3, 16, 16>;
+            }
+            if (ksize == 1 && in_c4 == 16 && out_c == 16)
+            {
+                return board_conv2d_int8_vnni<2, 1, 16, 16>;
+            }
+            if (out_c % 16 == 0)
+            {
+                return board_conv2d_int8_vnni<2>;
+            }
+            if (out_c % 8 == 0)
+            {
+                return board_conv2d_int8_vnni<1>;
+            }
+        }
+        if (cpu_has_avx2())
+        {
+            if (ksize == 3 && in_c4 == 16 && out_c == 16)
+            {
+                return board_conv2d_int8_avx2<2, 3, 16, 16>;
+            }
+            if (ksize == 1 && in_c4 == 16 && out_c == 16)
+            {
+                return board_conv2d_int8_avx2<2, 1, 16, 16>;
+            }
+            if (out_c % 16 == 0)
+            {
+                return board_conv2d_int8_avx2<2>;
+            }
+            if (out_c % 8 == 0)
+            {
+                return board_conv2d_int8_avx2<1>;
+            }
+        }
+#endif
+        return nullptr;
+    }
+
+public:
+    // SIMD実装で計算できる形状か。そうでなければスカラー実装になり、floatの畳み込みより遅い。
+    static bool has_simd_kernel(int ksize, int in_c, int out_c)
+    {
+        return out_c % 8 == 0 && select_kernel(ksize, int8_channels(in_c), out_c) != nullptr;
+    }
+
+    BoardConv2DInt8() : ksize(0), in_c(0), in_c4(0), out_c(0), kernel_func(nullptr)
+    {
+    }
+
+    // kernel: (ksize, ksize, in_c, out_c)、bias: (out_c)。in_scale: 入力の量子化の刻み、out_step_scale: 出力の量子化の刻み
+    BoardConv2DInt8(const float *kernel, const float *bias, int ksize, int in_c, int out_c, float in_scale, float out_step_scale)
+        : ksize(ksize), in_c(in_c), in_c4(int8_channels(in_c)), out_c(out_c), kernel_func(select_kernel(ksize, int8_channels(in_c), out_c))
+    {
+        if (ksize % 2 == 0 || ksize / 2 > (PADDED_SIZE - BOARD_SIZE) / 2 || out_c % 8 != 0)
+        {
+            throw runtime_error("BoardConv2DInt8: unsupported shape");
+        }
+        packed_kernel.assign(ksize * ksize * in_c4 * out_c, 0);
+        out_scale.resize(out_c);
+        out_bias.resize(out_c);
+        for (int oc = 0; oc < out_c; oc++)
+        {
+            float abs_max = 0.0F;
+            for (int i = 0; i < ksize * ksize * in_c; i++)
+            {
+                abs_max = max(abs_max, abs(kernel[i * out_c + oc]));
+            }
+            float w_scale = abs_max > 0.0F ? abs_max / INT8_WEIGHT_MAX : 1.0F;
+            for (int k = 0; k < ksize * ksize; k++)
+            {
+                for (int ic = 0; ic < in_c; ic++)
+                {
+                    packed_kernel[((k * in_c4 + ic / 4 * 4) * out_c + oc * 4) + ic % 4] = static_cast<int8_t>(lrintf(kernel[(k * in_c + ic) * out_c + oc] / w_scale));
+                }
+            }
+            out_scale[oc] = in_scale * w_scale / out_step_scale;
+            out_bias[oc] = bias[oc] / out_step_scale;
+        }
+    }
+
+    void forward(const uint8_t *x, uint8_t *y, int n) const
+    {
+        if (kernel_func)
+        {
+            kernel_func(packed_kernel.data(), out_scale.data(), out_bias.data(), x, y, n, ksize, in_c4, out_c);
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            forward_generic(x + i * PADDED_AREA * in_c4, y + i * PADDED_AREA * out_c);
+        }
+    }
+
+private:
+    void forward_generic(const uint8_t *x, uint8_t *y) const
+    {
+        const int pad = ksize / 2;
+        for (int pos = 0; pos < BOARD_AREA; pos++)
+        {
+            const int oy = pos / BOARD_SIZE, ox = pos % BOARD_SIZE;
+            uint8_t *yp = y + ((oy + 1) * PADDED_SIZE + (ox + 1)) * out_c;
+            for (int oc = 0; oc < out_c; oc++)
+            {
+                int32_t acc = 0;
+                for (int ky = 0; ky < ksize; ky++)
+                {
+                    for (int kx = 0; kx < ksize; kx++)
+                    {
+                        const uint8_t *xp = x + ((oy + 1 - pad + ky) * PADDED_SIZE + (ox + 1 - pad + kx)) * in_c4;
+                        const int8_t *w = &packed_kernel[(ky * ksize + kx) * in_c4 * out_c];
+                        for (int ic = 0; ic < in_c4; ic++)
+                        {
+                            acc += int32_t(xp[ic]) * int32_t(w[(ic / 4 * out_c + oc) * 4 + ic % 4]);
+                        }
+                    }
+                }
+                yp[oc] = quantize_activation(float(acc) * out_scale[oc] + out_bias[oc], 1.0F);
+            }
+        }
+    }
+};
+#endif
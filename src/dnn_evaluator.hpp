@@ -50,6 +50,32 @@ public:
 class DNNEvaluator
 {
 public:
+    virtual ~DNNEvaluator() = default;
+
     virtual DNNEvaluatorResult evaluate(const Board &board) = 0;
+
+    // 複数局面をまとめて評価する。バッチ推論に対応していない評価器では1局面ずつ評価する。
+    virtual void evaluate_batch(const Board *boards, DNNEvaluatorResult *results, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            results[i] = evaluate(boards[i]);
+        }
+    }
+
+    // 価値(value_logit)だけを求める。方策を使わない探索(αβ探索の末端など)向け。
+    // 方策の出力を省略できる評価器はこれをオーバーライドする。それ以外では評価結果全体から取り出す。
+    virtual float evaluate_value(const Board &board)
+    {
+        return evaluate(board).value_logit;
+    }
+
+    virtual void evaluate_value_batch(const Board *boards, float *values, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            values[i] = evaluate_value(boards[i]);
+        }
+    }
 };
 #endif
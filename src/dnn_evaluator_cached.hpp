@@ -0,0 +1,312 @@
+#ifndef _DNN_EVALUATOR_CACHED_
+#define _DNN_EVALUATOR_CACHED_
+
+#include <memory>
+#include "dnn_evaluator.hpp"
+
+// 任意のDNNEvaluatorをラップし、評価結果をキャッシュする。
+// 前の手の探索で評価済みの局面や、前のゲームで現れた局面(序盤)の再評価を避ける。
+// セットアソシアティブ方式で、各セット内はLRUで置き換える。
+class DNNEvaluatorCached : public DNNEvaluator
+{
+public:
+    class DNNEvaluatorCachedConfig
+    {
+    public:
+        // キャッシュに使うメモリ量の上限[byte]
+        size_t memory_budget_bytes;
+        // 対称変換(8通り)で正規化した局面をキーとするか。falseなら局面そのもののハッシュをキーとする。
+        bool use_symmetry;
+    };
+
+private:
+    static const int n_ways = 4; // 1セットあたりのエントリ数
+
+    class CacheEntry
+    {
+    public:
+        BoardPlane player;   // 手番側の石
+        BoardPlane opponent; // 相手側の石
+        uint32_t last_used;  // 最後に参照された時刻(LRU用)。0は空きエントリ。
+        DNNEvaluatorResult result;
+    };
+
+    class Key
+    {
+    public:
+        BoardPlane player, opponent;
+        int sym; // 元の局面からキーの局面への対称変換
+    };
+
+    shared_ptr<DNNEvaluator> base_evaluator;
+    DNNEvaluatorCachedConfig config;
+    vector<CacheEntry> entries;
+    size_t set_mask;
+    uint32_t clock;
+    long long _hit_count, _miss_count;
+    // evaluate_batch、evaluate_value_batchでヒットしなかった局面。呼び出しごとの確保を避けるため使い回す。
+    vector<int> miss_indices;
+    vector<Key> miss_keys;
+    vector<Board> miss_boards;
+    vector<DNNEvaluatorResult> miss_results;
+    vector<float> miss_values;
+
+public:
+    DNNEvaluatorCached(shared_ptr<DNNEvaluator> base_evaluator, const DNNEvaluatorCachedConfig &config)
+        : base_evaluator(base_evaluator), config(config), clock(0), _hit_count(0), _miss_count(0)
+    {
+        // セット数はメモリ量に収まる最大の2の冪
+        size_t n_sets = 1;
+        while (n_sets * 2 * n_ways * sizeof(CacheEntry) <= config.memory_budget_bytes)
+        {
+            n_sets *= 2;
+        }
+        set_mask = n_sets - 1;
+        entries.resize(n_sets * n_ways);
+        clear();
+    }
+
+    void clear()
+    {
+        for (auto &entry : entries)
+        {
+            entry.last_used = 0;
+        }
+        clock = 0;
+    }
+
+    long long hit_count() const
+    {
+        return _hit_count;
+    }
+
+    long long miss_count() const
+    {
+        return _miss_count;
+    }
+
+    size_t capacity() const
+    {
+        return entries.size();
+    }
+
+    string stats_string() const
+    {
+        long long total = _hit_count + _miss_count;
+        stringstream ss;
+        ss << "cache hit " << _hit_count << " miss " << _miss_count << " rate " << (total ? _hit_count * 100 / total : 0) << "%";
+        return ss.str();
+    }
+
+    DNNEvaluatorResult evaluate(const Board &board)
+    {
+        DNNEvaluatorResult result;
+        Key key = make_key(board);
+        const CacheEntry *entry = find(key);
+        if (entry)
+        {
+            _hit_count++;
+            restore_result(entry->result, key.sym, result);
+        }
+        else
+        {
+            _miss_count++;
+            result = base_evaluator->evaluate(board);
+            put(key, result);
+        }
+        return result;
+    }
+
+    void evaluate_batch(const Board *boards, DNNEvaluatorResult *results, int n)
+    {
+        // ヒットしなかった局面だけをまとめてbase_evaluatorに渡す
+        miss_indices.clear();
+        miss_keys.clear();
+        miss_boards.clear();
+        for (int i = 0; i < n; i++)
+        {
+            Key key = make_key(boards[i]);
+            const CacheEntry *entry = find(key);
+            if (entry)
+            {
+                _hit_count++;
+                restore_result(entry->result, key.sym, results[i]);
+            }
+            else
+            {
+                _miss_count++;
+                miss_indices.push_back(i);
+                miss_keys.push_back(key);
+                miss_boards.push_back(boards[i]);
+            }
+        }
+
+        if (miss_boards.empty())
+        {
+            return;
+        }
+        miss_results.resize(miss_boards.size());
+        base_evaluator->evaluate_batch(&miss_boards[0], &miss_results[0], int(miss_boards.size()));
+        for (size_t j = 0; j < miss_boards.size(); j++)
+        {
+            results[miss_indices[j]] = miss_results[j];
+            put(miss_keys[j], miss_results[j]);
+        }
+    }
+
+    // 価値だけを求める。キャッシュにあればその価値を返し、なければbase_evaluatorで価値だけを求める。
+    // 方策がないので、価値だけを求めた結果はキャッシュに入れない。
+    float evaluate_value(const Board &board)
+    {
+        const CacheEntry *entry = find(make_key(board));
+        if (entry)
+        {
+            _hit_count++;
+            return entry->result.value_logit;
+        }
+        _miss_count++;
+        return base_evaluator->evaluate_value(board);
+    }
+
+    void evaluate_value_batch(const Board *boards, float *values, int n)
+    {
+        miss_indices.clear();
+        miss_boards.clear();
+        for (int i = 0; i < n; i++)
+        {
+            const CacheEntry *entry = find(make_key(boards[i]));
+            if (entry)
+            {
+                _hit_count++;
+                values[i] = entry->result.value_logit;
+            }
+            else
+            {
+                _miss_count++;
+                miss_indices.push_back(i);
+                miss_boards.push_back(boards[i]);
+            }
+        }
+
+        if (miss_boards.empty())
+        {
+            return;
+        }
+        miss_values.resize(miss_boards.size());
+        base_evaluator->evaluate_value_batch(&miss_boards[0], &miss_values[0], int(miss_boards.size()));
+        for (size_t j = 0; j < miss_boards.size(); j++)
+        {
+            values[miss_indices[j]] = miss_values[j];
+        }
+    }
+
+private:
+    Key make_key(const Board &board) const
+    {
+        Key key;
+        key.player = board.plane(board.turn());
+        key.opponent = board.plane(1 - board.turn());
+        key.sym = 0;
+        if (config.use_symmetry)
+        {
+            for (int sym = 1; sym < 8; sym++)
+            {
+                BoardPlane p = transform_plane(board.plane(board.turn()), sym);
+                BoardPlane o = transform_plane(board.plane(1 - board.turn()), sym);
+                if (p < key.player || (p == key.player && o < key.opponent))
+                {
+                    key.player = p;
+                    key.opponent = o;
+                    key.sym = sym;
+                }
+            }
+        }
+        return key;
+    }
+
+    CacheEntry *set_begin(const Key &key)
+    {
+        size_t set_idx = splitmix64(key.player ^ splitmix64(key.opponent)) & set_mask;
+        return &entries[set_idx * n_ways];
+    }
+
+    const CacheEntry *find(const Key &key)
+    {
+        CacheEntry *set = set_begin(key);
+        for (int way = 0; way < n_ways; way++)
+        {
+            CacheEntry *entry = &set[way];
+            if (entry->last_used && entry->player == key.player && entry->opponent == key.opponent)
+            {
+                entry->last_used = tick();
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    void put(const Key &key, const DNNEvaluatorResult &result)
+    {
+        // 空き、または最も長く使われていないエントリを置き換える
+        CacheEntry *set = set_begin(key);
+        CacheEntry *victim = &set[0];
+        for (int way = 0; way < n_ways; way++)
+        {
+            CacheEntry *entry = &set[way];
+            if (entry->last_used && entry->player == key.player && entry->opponent == key.opponent)
+            {
+                // 同一バッチ内の重複局面
+                victim = entry;
+                break;
+            }
+            if (entry->last_used < victim->last_used)
+            {
+                victim = entry;
+            }
+        }
+        victim->player = key.player;
+        victim->opponent = key.opponent;
+        victim->last_used = tick();
+        if (key.sym)
+        {
+            // policyはキーの局面の向きで保存する
+            victim->result.value_logit = result.value_logit;
+            for (Position pos = 0; pos < BOARD_AREA; pos++)
+            {
+                victim->result.policy_logits[transform_position(pos, key.sym)] = result.policy_logits[pos];
+            }
+        }
+        else
+        {
+            victim->result = result;
+        }
+    }
+
+    void restore_result(const DNNEvaluatorResult &stored, int sym, DNNEvaluatorResult &result) const
+    {
+        if (sym)
+        {
+            result.value_logit = stored.value_logit;
+            for (Position pos = 0; pos < BOARD_AREA; pos++)
+            {
+                result.policy_logits[pos] = stored.policy_logits[transform_position(pos, sym)];
+            }
+        }
+        else
+        {
+            result = stored;
+        }
+    }
+
+    uint32_t tick()
+    {
+        if (++clock == 0)
+        {
+            // 一周したら全エントリを無効化する(長時間の自己対局でのみ起こる)
+            clear();
+            clock = 1;
+        }
+        return clock;
+    }
+};
+#endif
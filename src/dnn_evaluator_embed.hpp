@@ -1,231 +1,182 @@
 #ifndef _DNN_EVALUATOR_EMBED_
 #define _DNN_EVALUATOR_EMBED_
 
-#include <memory>
+#include <chrono>
 #include "dnn_evaluator.hpp"
+#include "dnn_model.hpp"
 #include "base64.hpp"
 #include "_dnn_weight.hpp"
 
+// DNNEvaluatorEmbedの構築にかかった時間(マイクロ秒)。起動直後の評価が遅れないかの確認用。
+class DNNEvaluatorEmbedStartupTime
+{
+public:
+    double decode_us = 0.0; // base64の復号
+    double parse_us = 0.0;  // モデル記述の読み込み(bfloat16からfloatへの変換を含む)
+    double plan_us = 0.0;   // 各層の実装の選択と重みの並べ替え、バッファの確保
+};
+
+// ソースに埋め込んだモデル記述(embed_weight.pyで生成した_dnn_weight.hpp、形式はdnn_model.hpp)を読み込んで評価する
 class DNNEvaluatorEmbed : public DNNEvaluator
 {
-    class DNNWeight
-    {
-    public:
-        float conv2d_8_kernel[16];
-        float conv2d_8_bias[1];
-        float dense_kernel[1024];
-        float dense_bias[1];
-        float conv_bn_conv2d_kernel[432];
-        float conv_bn_conv2d_bias[16];
-        float conv_bn_1_conv2d_1_kernel[2304];
-        float conv_bn_1_conv2d_1_bias[16];
-        float conv_bn_2_conv2d_2_kernel[2304];
-        float conv_bn_2_conv2d_2_bias[16];
-        float conv_bn_3_conv2d_3_kernel[2304];
-        float conv_bn_3_conv2d_3_bias[16];
-        float conv_bn_4_conv2d_4_kernel[2304];
-        float conv_bn_4_conv2d_4_bias[16];
-        float conv_bn_5_conv2d_5_kernel[2304];
-        float conv_bn_5_conv2d_5_bias[16];
-        float conv_bn_6_conv2d_6_kernel[2304];
-        float conv_bn_6_conv2d_6_bias[16];
-        float conv_bn_7_conv2d_7_kernel[256];
-        float conv_bn_7_conv2d_7_bias[16];
-        float conv_bn_8_conv2d_9_kernel[256];
-        float conv_bn_8_conv2d_9_bias[16];
-    };
-    FeatureExtractor extractor;
-    DNNWeight weight;
-
-    class Tensor
-    {
-    public:
-        float *data;
-        bool owndata = false;
-        array<int, 4> shape; // 簡単のため常に4Dで扱う。(batch, h, w, c) or (batch, 1, 1, c) or (1, 1, 1, c)
-        array<int, 4> strides;
-        int size;
-        Tensor(array<int, 4> shape, float *data = nullptr) : data(data), shape(shape)
-        {
-            size = 1;
-            for (size_t i = shape.size() - 1; i < shape.size(); i--)
-            {
-                strides[i] = size;
-                size *= shape[i];
-            }
-            if (!data)
-            {
-                owndata = true;
-                this->data = new float[size];
-            }
-        }
+    DNNModelDesc model;
+    // 形状に合わせて実装を選んだ各層。モデル記述の読み込み後に構築する。
+    vector<DNNFloatLayer> layers;
+    // 評価する層の番号。value_layersは価値だけを求める場合(方策の出力だけに使われる層を除く)。
+    vector<int> all_layers, value_layers;
+
+    // 一度に評価する局面数の上限。これを超えるバッチは分割して評価する。バッチ全体の活性がL2キャッシュに収まる程度とする。
+    static constexpr int max_batch = 16;
+
+    // 評価に用いる活性のバッファ。局面ごとの活性を続けて並べる(max_batch, テンソル1局面分の要素数)。
+    // 生存期間が重ならないテンソルはバッファを共有する(assign_tensor_buffers)。
+    // 評価器の構築時に確保し、評価中はヒープ確保をしない。
+    // 盤面上の活性は周囲に0を加えた形式(dnn_conv.hpp)で、各層は内側だけを書き込むため、周囲は構築時に0にすれば以降も0のまま。
+    vector<int> tensor_buffer;
+    vector<vector<float>> buffers;
+    vector<float> work; // 盤面から直接計算する層(BoardInputConv2D)の作業領域
+
+    DNNEvaluatorEmbedStartupTime startup_time;
+
+    static double elapsed_us(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    }
 
-        ~Tensor()
+    void build_layers()
+    {
+        auto start = chrono::steady_clock::now();
+        size_t work_size = 0;
+        for (int i = 0; i < int(model.layers.size()); i++)
         {
-            if (owndata)
-            {
-                delete[] data;
-            }
+            layers.emplace_back(model, i);
+            work_size = max(work_size, size_t(layers.back().work_size()));
         }
-
-        float &v(int n, int h, int w, int c)
+        all_layers = model.required_layers({model.policy_output, model.value_output});
+        value_layers = model.required_layers({model.value_output});
+        // 評価しない層の出力は、評価する層からは読まれないので、バッファを共有していても問題ない
+        vector<int> buffer_sizes;
+        assign_tensor_buffers(model, tensor_buffer, buffer_sizes);
+        for (int size : buffer_sizes)
         {
-            return data[n * strides[0] + h * strides[1] + w * strides[2] + c * strides[3]];
+            buffers.emplace_back(max_batch * size);
         }
+        work.resize(work_size);
+        startup_time.plan_us = elapsed_us(start);
+    }
 
-        float &v(int n, int c)
-        {
-            return data[n * strides[0] + c * strides[3]];
-        }
+    float *tensor_data(int tensor)
+    {
+        return tensor > 0 ? buffers[tensor_buffer[tensor]].data() : nullptr;
+    }
 
-        float &v(int c)
-        {
-            return data[c * strides[3]];
-        }
-    };
-
-    using PTensor = shared_ptr<Tensor>;
-
-    PTensor tensor(array<int, 4> shape, float *data = nullptr)
-    {
-        return PTensor(new Tensor(shape, data));
-    }
-
-    PTensor conv2d(PTensor x, PTensor w, PTensor b, int pad, int stride)
-    {
-        // x: (n=1, h, w, in_c)
-        // w: (kh, kw, in_c, out_c)
-        // b: (1, 1, 1, out_c)
-        // y: (n=1, out_h, out_w, out_c)
-        int in_h = x->shape[1], in_w = x->shape[2], in_c = x->shape[3];
-        int kh = w->shape[0], kw = w->shape[1], out_c = w->shape[3];
-        int out_h = (in_h + 2 * pad - kh) / stride + 1;
-        int out_w = (in_w + 2 * pad - kw) / stride + 1;
-        PTensor y = tensor({1, out_h, out_w, out_c});
-        for (int out_y = 0; out_y < out_h; out_y++)
-            for (int out_x = 0; out_x < out_w; out_x++)
-                for (int oc = 0; oc < out_c; oc++)
-                {
-                    float sum = b->v(oc);
-                    for (int ky = 0; ky < kh; ky++)
-                        for (int kx = 0; kx < kw; kx++)
-                        {
-                            int in_y = out_y * stride - pad + ky;
-                            int in_x = out_x * stride - pad + kx;
-                            if (in_y < 0 || in_y >= in_h || in_x < 0 || in_x >= in_w)
-                            {
-                                continue;
-                            }
-                            for (int ic = 0; ic < in_c; ic++)
-                            {
-                                sum += x->v(0, in_y, in_x, ic) * w->v(ky, kx, ic, oc);
-                            }
-                        }
-
-                    y->v(0, out_y, out_x, oc) = sum;
-                }
-        return y;
-    }
-
-    PTensor dense(PTensor x, PTensor w, PTensor b)
-    {
-        // x: (n=1, 1, 1, in_c)
-        // w: (in_c, 1, 1, out_c)
-        // b: (1, 1, 1, out_c)
-        // y: (n=1, 1, 1, out_c)
-        PTensor y = tensor({1, 1, 1, w->shape[3]});
-        for (int n = 0; n < w->shape[3]; n++)
-        {
-            float sum = b->v(n);
-            for (int k = 0; k < w->shape[0]; k++)
-            {
-                sum += x->v(k) * w->v(k, n);
-            }
-            y->v(n) = sum;
-        }
-        return y;
+public:
+    DNNEvaluatorEmbed()
+    {
+        auto start = chrono::steady_clock::now();
+        auto weight_raw = b64decode(dnn_weight_base64, sizeof(dnn_weight_base64) - 1);
+        startup_time.decode_us = elapsed_us(start);
+        start = chrono::steady_clock::now();
+        model = DNNModelDesc::parse(weight_raw.data(), weight_raw.size());
+        startup_time.parse_us = elapsed_us(start);
+        build_layers();
+    }
+
+    // モデル記述を指定する(DNNModelDesc::load_fileでファイルから読んだものなど)
+    DNNEvaluatorEmbed(DNNModelDesc model) : model(move(model))
+    {
+        build_layers();
     }
 
-    void relu_inplace(PTensor x)
+    ~DNNEvaluatorEmbed()
     {
-        for (int i = 0; i < x->size; i++)
+    }
+
+    const DNNModelDesc &get_model() const
+    {
+        return model;
+    }
+
+    const DNNEvaluatorEmbedStartupTime &get_startup_time() const
+    {
+        return startup_time;
+    }
+
+    DNNEvaluatorResult evaluate(const Board &board)
+    {
+        DNNEvaluatorResult res;
+        evaluate_chunk(&board, &res, 1);
+        return res;
+    }
+
+    // 各層をバッチ全体に適用してから次の層に進むことで、層の重みを読み込んだまま全局面に使う
+    void evaluate_batch(const Board *boards, DNNEvaluatorResult *results, int n)
+    {
+        for (int begin = 0; begin < n; begin += max_batch)
         {
-            x->data[i] = max(x->data[i], 0.0F);
+            evaluate_chunk(&boards[begin], &results[begin], min(max_batch, n - begin));
         }
     }
 
-    void flatten_inplace(PTensor x)
+    float evaluate_value(const Board &board)
     {
-        // flatten inplace
-        // (n, h, w, c) => (n, 1, 1, c)
-        int newc = x->shape[1] * x->shape[2] * x->shape[3];
-        x->shape = {x->shape[0], 1, 1, newc};
-        x->strides = {x->strides[0], 0, 0, 1};
+        float value;
+        evaluate_value_chunk(&board, &value, 1);
+        return value;
     }
 
-    void set_weight_float32(const uint8_t* raw)
+    void evaluate_value_batch(const Board *boards, float *values, int n)
     {
-        memcpy(&weight, raw, sizeof(weight));
+        for (int begin = 0; begin < n; begin += max_batch)
+        {
+            evaluate_value_chunk(&boards[begin], &values[begin], min(max_batch, n - begin));
+        }
     }
 
-    void set_weight_bfloat16(const uint8_t* raw)
+    // 量子化(DNNEvaluatorEmbedInt8)のキャリブレーション用。n局面を評価し、ReLUを適用する層の出力の最大値で
+    // layer_max(層の数の要素を持つ。i番目がi番目の層の出力)を更新する。
+    void accumulate_activation_max(const Board *boards, DNNEvaluatorResult *results, int n, float *layer_max)
     {
-        uint8_t *ptr = reinterpret_cast<uint8_t*>(&weight);
-        for (size_t i = 0; i < sizeof(weight); i += 4)
+        for (int begin = 0; begin < n; begin += max_batch)
         {
-            ptr[i] = 0;
-            ptr[i+1] = 0;
-            ptr[i+2] = *raw++;
-            ptr[i+3] = *raw++;
+            evaluate_chunk(&boards[begin], &results[begin], min(max_batch, n - begin), layer_max);
         }
     }
 
-public:
-    DNNEvaluatorEmbed() : extractor()
+private:
+    void forward_layers(const vector<int> &indices, const Board *boards, int n, float *layer_max = nullptr)
     {
-        auto weight_raw = b64decode(dnn_weight_base64, sizeof(dnn_weight_base64) - 1);
-        set_weight_bfloat16(&weight_raw[0]);
+        for (int i : indices)
+        {
+            const DNNLayerDesc &desc = layers[i].desc;
+            float *y = tensor_data(i + 1);
+            layers[i].forward(boards, tensor_data(desc.input), desc.residual >= 0 ? tensor_data(desc.residual) : nullptr, y, n, work.data());
+            if (layer_max && desc.relu)
+            {
+                layer_max[i] = max(layer_max[i], *max_element(y, y + n * model.buffer_size(i + 1)));
+            }
+        }
     }
 
-    ~DNNEvaluatorEmbed()
+    void evaluate_chunk(const Board *boards, DNNEvaluatorResult *results, int n, float *layer_max = nullptr)
     {
+        forward_layers(all_layers, boards, n, layer_max);
+        const float *policy_out = tensor_data(model.policy_output);
+        const float *value_out = tensor_data(model.value_output);
+        for (int i = 0; i < n; i++)
+        {
+            for (int row = 0; row < BOARD_SIZE; row++)
+            {
+                memcpy(&results[i].policy_logits[row * BOARD_SIZE], &policy_out[i * PADDED_AREA + (row + 1) * PADDED_SIZE + 1], BOARD_SIZE * sizeof(float));
+            }
+            results[i].value_logit = value_out[i];
+        }
     }
 
-    DNNEvaluatorResult evaluate(const Board &board)
+    void evaluate_value_chunk(const Board *boards, float *values, int n)
     {
-        DNNInputFeature req = extractor.extract(board);
-        const int ch = 16;
-        PTensor h = tensor({1, BOARD_SIZE, BOARD_SIZE, 3}, req.board_repr);
-        h = conv2d(h, tensor({3, 3, 3, ch}, weight.conv_bn_conv2d_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_conv2d_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_1_conv2d_1_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_1_conv2d_1_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_2_conv2d_2_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_2_conv2d_2_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_3_conv2d_3_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_3_conv2d_3_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_4_conv2d_4_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_4_conv2d_4_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_5_conv2d_5_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_5_conv2d_5_bias), 1, 1);
-        relu_inplace(h);
-        h = conv2d(h, tensor({3, 3, ch, ch}, weight.conv_bn_6_conv2d_6_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_6_conv2d_6_bias), 1, 1);
-        relu_inplace(h);
-
-        auto p = h, v = h;
-
-        p = conv2d(p, tensor({1, 1, ch, ch}, weight.conv_bn_7_conv2d_7_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_7_conv2d_7_bias), 0, 1);
-        relu_inplace(p);
-        p = conv2d(p, tensor({1, 1, ch, 1}, weight.conv2d_8_kernel), tensor({1, 1, 1, 1}, weight.conv2d_8_bias), 0, 1);
-
-        v = conv2d(v, tensor({1, 1, ch, ch}, weight.conv_bn_8_conv2d_9_kernel), tensor({1, 1, 1, ch}, weight.conv_bn_8_conv2d_9_bias), 0, 1);
-        relu_inplace(v);
-        flatten_inplace(v);
-        v = dense(v, tensor({ch * BOARD_AREA, 1, 1, 1}, weight.dense_kernel), tensor({1, 1, 1, 1}, weight.dense_bias));
-
-        DNNEvaluatorResult res;
-        memcpy(res.policy_logits, p->data, sizeof(res.policy_logits));
-        memcpy(&res.value_logit, v->data, sizeof(res.value_logit));
-        return res;
+        forward_layers(value_layers, boards, n);
+        memcpy(values, tensor_data(model.value_output), n * sizeof(float));
     }
 };
 #endif
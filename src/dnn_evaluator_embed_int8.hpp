@@ -0,0 +1,267 @@
+#ifndef _DNN_EVALUATOR_EMBED_INT8_
+#define _DNN_EVALUATOR_EMBED_INT8_
+
+#include <fstream>
+#include "dnn_evaluator_embed.hpp"
+#include "dnn_conv_int8.hpp"
+
+// キャリブレーション結果(DNNEvaluatorEmbed::accumulate_activation_maxで求めた各活性の最大値)を、1行1個のテキストとして保存する
+inline void save_int8_calibration(const string &path, const vector<float> &layer_max)
+{
+    ofstream fout(path);
+    if (!fout)
+    {
+        throw runtime_error("failed to open " + path);
+    }
+    fout.precision(9);
+    for (float v : layer_max)
+    {
+        fout << v << endl;
+    }
+}
+
+inline vector<float> load_int8_calibration(const string &path)
+{
+    ifstream fin(path);
+    if (!fin)
+    {
+        throw runtime_error("failed to open " + path);
+    }
+    vector<float> layer_max;
+    float v;
+    while (fin >> v)
+    {
+        layer_max.push_back(v);
+    }
+    return layer_max;
+}
+
+// DNNEvaluatorEmbedと同じモデルを、int8に量子化して評価する。
+// 量子化するのは、ReLUを適用し残差接続のない、SIMD実装がある形状(BoardConv2DInt8::has_simd_kernel)の畳み込み層の出力。ReLU後の活性はキャリブレーションで求めた
+// 最大値を127とするuint8で保持する。入力が量子化済みの層は重みを出力チャンネルごとにint8へ量子化し、int32で累積する(dnn_conv_int8.hpp)。
+// 入力テンソルを読む層はfloatのまま盤面から直接計算し(BoardInputConv2D)、出力を量子化する。
+// それ以外の層(方策・価値の出力、全結合、残差接続など)はfloatで計算し、入力が量子化されていればfloatに戻したものを使う。
+class DNNEvaluatorEmbedInt8 : public DNNEvaluator
+{
+    static constexpr int max_batch = 16;
+
+    enum LayerKind
+    {
+        LAYER_FLOAT,       // floatで計算する
+        LAYER_INPUT_INT8,  // 盤面からfloatで計算し、出力を量子化する
+        LAYER_INT8,        // 量子化した入力からint8で計算する
+    };
+
+    DNNModelDesc model;
+    vector<LayerKind> kinds;
+    vector<DNNFloatLayer> float_layers; // LAYER_FLOAT、LAYER_INPUT_INT8の層
+    vector<BoardConv2DInt8> int8_layers; // LAYER_INT8の層
+    vector<int> all_layers, value_layers; // 評価する層の番号(DNNEvaluatorEmbedと同じ)
+
+    // テンソルごとの活性。量子化するテンソルはq_buffersに、floatで読む層があるテンソルはf_buffersに持つ(両方のこともある)。
+    // 使わない方は空。DNNEvaluatorEmbedと同じく盤面は周囲に0を加えた形式で、構築時に0にしておく。
+    vector<float> scales; // 量子化するテンソルの刻み。それ以外は0。
+    vector<vector<uint8_t>> q_buffers;
+    vector<vector<float>> f_buffers;
+    vector<float> work;
+
+public:
+    // layer_max: DNNEvaluatorEmbed::accumulate_activation_maxで求めた各層の出力の最大値
+    DNNEvaluatorEmbedInt8(const DNNEvaluatorEmbed &float_evaluator, const vector<float> &layer_max)
+        : model(float_evaluator.get_model())
+    {
+        const int n_layers = model.layers.size();
+        if (int(layer_max.size()) != n_layers)
+        {
+            throw runtime_error("DNNEvaluatorEmbedInt8: invalid calibration");
+        }
+        const int n_tensors = model.n_tensors();
+        scales.assign(n_tensors, 0.0F);
+        vector<bool> float_used(n_tensors, false);
+        float_used[model.policy_output] = float_used[model.value_output] = true;
+        kinds.resize(n_layers);
+        float_layers.resize(n_layers);
+        int8_layers.resize(n_layers);
+        for (int i = 0; i < n_layers; i++)
+        {
+            const DNNLayerDesc &desc = model.layers[i];
+            // SIMD実装のない形状(CPUが対応していない場合を含む)はfloatで計算する
+            const bool quantizable = desc.type == DNN_LAYER_CONV2D && desc.relu && desc.residual < 0 && BoardConv2DInt8::has_simd_kernel(desc.ksize, desc.in_c, desc.out_c);
+            if (quantizable && desc.input == 0)
+            {
+                kinds[i] = LAYER_INPUT_INT8;
+            }
+            else if (quantizable && scales[desc.input] > 0.0F)
+            {
+                kinds[i] = LAYER_INT8;
+            }
+            else
+            {
+                kinds[i] = LAYER_FLOAT;
+                float_used[desc.input] = true;
+                if (desc.residual >= 0)
+                {
+                    float_used[desc.residual] = true;
+                }
+            }
+            if (kinds[i] == LAYER_INT8)
+            {
+                scales[i + 1] = layer_max[i] > 0.0F ? layer_max[i] / INT8_ACTIVATION_MAX : 1.0F;
+                int8_layers[i] = BoardConv2DInt8(desc.kernel.data(), desc.bias.data(), desc.ksize, desc.in_c, desc.out_c, scales[desc.input], scales[i + 1]);
+            }
+            else
+            {
+                if (kinds[i] == LAYER_INPUT_INT8)
+                {
+                    scales[i + 1] = layer_max[i] > 0.0F ? layer_max[i] / INT8_ACTIVATION_MAX : 1.0F;
+                }
+                float_layers[i] = DNNFloatLayer(model, i);
+                work.resize(max(work.size(), size_t(float_layers[i].work_size())));
+            }
+        }
+        all_layers = model.required_layers({model.policy_output, model.value_output});
+        value_layers = model.required_layers({model.value_output});
+        q_buffers.resize(n_tensors);
+        f_buffers.resize(n_tensors);
+        for (int t = 1; t < n_tensors; t++)
+        {
+            if (scales[t] > 0.0F)
+            {
+                q_buffers[t].resize(max_batch * model.buffer_size(t));
+            }
+            if (scales[t] == 0.0F || float_used[t])
+            {
+                f_buffers[t].resize(max_batch * model.buffer_size(t));
+            }
+        }
+        // 重みは各層の構築で変換済み
+        for (auto &desc : model.layers)
+        {
+            desc.kernel.clear();
+        }
+    }
+
+    DNNEvaluatorEmbedInt8(const vector<float> &layer_max) : DNNEvaluatorEmbedInt8(DNNEvaluatorEmbed(), layer_max)
+    {
+    }
+
+    DNNEvaluatorResult evaluate(const Board &board)
+    {
+        DNNEvaluatorResult res;
+        evaluate_chunk(&board, &res, 1);
+        return res;
+    }
+
+    void evaluate_batch(const Board *boards, DNNEvaluatorResult *results, int n)
+    {
+        for (int begin = 0; begin < n; begin += max_batch)
+        {
+            evaluate_chunk(&boards[begin], &results[begin], min(max_batch, n - begin));
+        }
+    }
+
+    float evaluate_value(const Board &board)
+    {
+        float value;
+        evaluate_value_chunk(&board, &value, 1);
+        return value;
+    }
+
+    void evaluate_value_batch(const Board *boards, float *values, int n)
+    {
+        for (int begin = 0; begin < n; begin += max_batch)
+        {
+            evaluate_value_chunk(&boards[begin], &values[begin], min(max_batch, n - begin));
+        }
+    }
+
+private:
+    float *float_data(int tensor)
+    {
+        return f_buffers[tensor].empty() ? nullptr : f_buffers[tensor].data();
+    }
+
+    void forward_layers(const vector<int> &indices, const Board *boards, int n)
+    {
+        for (int i : indices)
+        {
+            const DNNLayerDesc &desc = model.layers[i];
+            const int t = i + 1;
+            switch (kinds[i])
+            {
+            case LAYER_INT8:
+                int8_layers[i].forward(q_buffers[desc.input].data(), q_buffers[t].data(), n);
+                if (!f_buffers[t].empty())
+                {
+                    dequantize(t, n);
+                }
+                break;
+            case LAYER_INPUT_INT8:
+                for (int b = 0; b < n; b++)
+                {
+                    float_layers[i].forward_input(boards[b], work.data());
+                    quantize_dense(t, work.data(), b);
+                }
+                if (!f_buffers[t].empty())
+                {
+                    dequantize(t, n);
+                }
+                break;
+            case LAYER_FLOAT:
+                float_layers[i].forward(boards, float_data(desc.input), desc.residual >= 0 ? float_data(desc.residual) : nullptr, f_buffers[t].data(), n, work.data());
+                break;
+            }
+        }
+    }
+
+    void evaluate_chunk(const Board *boards, DNNEvaluatorResult *results, int n)
+    {
+        forward_layers(all_layers, boards, n);
+        const float *policy_out = f_buffers[model.policy_output].data();
+        const float *value_out = f_buffers[model.value_output].data();
+        for (int i = 0; i < n; i++)
+        {
+            for (int row = 0; row < BOARD_SIZE; row++)
+            {
+                memcpy(&results[i].policy_logits[row * BOARD_SIZE], &policy_out[i * PADDED_AREA + (row + 1) * PADDED_SIZE + 1], BOARD_SIZE * sizeof(float));
+            }
+            results[i].value_logit = value_out[i];
+        }
+    }
+
+    void evaluate_value_chunk(const Board *boards, float *values, int n)
+    {
+        forward_layers(value_layers, boards, n);
+        memcpy(values, f_buffers[model.value_output].data(), n * sizeof(float));
+    }
+
+    // 1局面分の出力(BOARD_AREA, ch)を量子化し、b番目の局面のバッファに書き込む
+    void quantize_dense(int tensor, const float *src, int b)
+    {
+        const int ch = model.channels(tensor);
+        const float scale = scales[tensor];
+        uint8_t *dst = &q_buffers[tensor][b * PADDED_AREA * ch];
+        for (int pos = 0; pos < BOARD_AREA; pos++)
+        {
+            uint8_t *dp = dst + ((pos / BOARD_SIZE + 1) * PADDED_SIZE + (pos % BOARD_SIZE + 1)) * ch;
+            for (int c = 0; c < ch; c++)
+            {
+                dp[c] = quantize_activation(src[pos * ch + c], scale);
+            }
+        }
+    }
+
+    // 量子化したテンソルをfloatに戻す。周囲の0はどちらも0のまま。
+    void dequantize(int tensor, int n)
+    {
+        const float scale = scales[tensor];
+        const uint8_t *src = q_buffers[tensor].data();
+        float *dst = f_buffers[tensor].data();
+        const int size = n * model.buffer_size(tensor);
+        for (int j = 0; j < size; j++)
+        {
+            dst[j] = float(src[j]) * scale;
+        }
+    }
+};
+#endif
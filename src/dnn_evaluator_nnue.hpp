@@ -0,0 +1,272 @@
+#ifndef _DNN_EVALUATOR_NNUE_
+#define _DNN_EVALUATOR_NNUE_
+
+#include <fstream>
+#include "dnn_evaluator.hpp"
+#include "dnn_conv_int8.hpp"
+
+// NNUE(efficiently updatable neural network)形式の評価器の、第1層の出力(アキュムレータ)。
+// 各プレイヤーから見た盤面(自分の石64マス、相手の石64マス)の特徴量に対する第1層の出力を、プレイヤーごとに保持する。
+// 着手で変化するのは置いた石と裏返った石だけなので、着手前のアキュムレータに差分を足して更新できる。
+class NNUEAccumulator
+{
+public:
+    static constexpr int hidden = 128;
+    // 第1層の出力を、1.0 = INT8_ACTIVATION_MAXとする固定小数点で保持する
+    alignas(32) int16_t values[N_PLAYER][hidden];
+};
+
+// NNUE形式の評価器。othello_train/nnue_train_v1.pyで学習した重みファイルを読み込む。
+// 構造: 特徴量(手番側の石64, 相手の石64) -> 全結合128 -> 全結合32 -> 全結合32 -> 価値(1)、方策(64)。活性化関数はclipped ReLU(0〜1にクリップ)。
+// 第1層はint16のアキュムレータ(NNUEAccumulator)で、差分更新する。以降の層は、活性を0〜INT8_ACTIVATION_MAXのuint8、
+// 重みを出力ごとにint8に量子化し、int32で積和する。clipped ReLUなので活性の範囲が決まっており、キャリブレーションは不要。
+// evaluate(board)はアキュムレータを盤面から作り直す。探索で差分更新する場合は、refresh / updateと、アキュムレータを受け取るevaluateを用いる。
+class DNNEvaluatorNNUE : public DNNEvaluator
+{
+public:
+    static constexpr int n_features = BOARD_AREA * 2;
+    static constexpr int hidden1 = NNUEAccumulator::hidden;
+    static constexpr int hidden2 = 32;
+    static constexpr int hidden3 = 32;
+
+private:
+    // 1.0を表す固定小数点の値
+    static constexpr float activation_one = float(INT8_ACTIVATION_MAX);
+
+    // 第1層。feature_kernel[f]は特徴量fに対応する出力hidden1個。
+    vector<int16_t> feature_kernel; // (n_features, hidden1)
+    vector<int16_t> feature_bias;   // (hidden1)
+    // 手番側の石が裏返って相手の石になったときの、第1層の出力の変化(相手の石の重み - 手番側の石の重み)
+    vector<int16_t> flip_kernel; // (BOARD_AREA, hidden1)
+
+    // int8に量子化した全結合層。kernelは出力ごとに入力in_c個が連続する。
+    class DenseInt8
+    {
+    public:
+        int in_c, out_c;
+        vector<int8_t> kernel;    // (out_c, in_c)
+        vector<float> out_scale;  // (out_c)。int32の積和をfloatに戻す係数。
+        vector<float> bias;       // (out_c)
+
+        DenseInt8() : in_c(0), out_c(0)
+        {
+        }
+
+        // kernel: (in_c, out_c) (TensorFlowのDenseと同じ並び)
+        DenseInt8(const float *src_kernel, const float *src_bias, int in_c, int out_c)
+            : in_c(in_c), out_c(out_c), kernel(in_c * out_c), out_scale(out_c), bias(src_bias, src_bias + out_c)
+        {
+            if (out_c > BOARD_AREA)
+            {
+                throw runtime_error("DNNEvaluatorNNUE: too many outputs");
+            }
+            vector<float> column(in_c);
+            for (int o = 0; o < out_c; o++)
+            {
+                for (int i = 0; i < in_c; i++)
+                {
+                    column[i] = src_kernel[i * out_c + o];
+                }
+                // 入力の1.0はactivation_oneなので、その分を係数に含める
+                out_scale[o] = quantize_weights(column.data(), in_c, &kernel[o * in_c]) / activation_one;
+            }
+        }
+
+        // 活性化関数を適用する前の出力を返す
+        void forward(const uint8_t *x, float *y) const
+        {
+            int32_t acc[BOARD_AREA];
+            dense_u8i8(x, kernel.data(), in_c, out_c, acc);
+            for (int o = 0; o < out_c; o++)
+            {
+                y[o] = float(acc[o]) * out_scale[o] + bias[o];
+            }
+        }
+    };
+    DenseInt8 dense2, dense3, value_dense, policy_dense;
+
+    static uint8_t clipped_relu(float x)
+    {
+        return quantize_activation(x, 1.0F / activation_one);
+    }
+
+    static void read_floats(ifstream &fin, vector<float> &dst, int n, const string &path)
+    {
+        dst.resize(n);
+        if (!fin.read(reinterpret_cast<char *>(dst.data()), n * sizeof(float)))
+        {
+            throw runtime_error("DNNEvaluatorNNUE: weight file is too short: " + path);
+        }
+    }
+
+    static int16_t to_fixed(float x)
+    {
+        return static_cast<int16_t>(lrintf(x * activation_one));
+    }
+
+public:
+    // weight_path: nnue_train_v1.pyが出力した重みファイル(float32の配列を層の順に並べたもの)
+    DNNEvaluatorNNUE(const string &weight_path)
+    {
+        ifstream fin(weight_path, ios::in | ios::binary);
+        if (!fin)
+        {
+            throw runtime_error("DNNEvaluatorNNUE: failed to open " + weight_path);
+        }
+        vector<float> w1, b1, w2, b2, w3, b3, wv, bv, wp, bp;
+        read_floats(fin, w1, n_features * hidden1, weight_path);
+        read_floats(fin, b1, hidden1, weight_path);
+        read_floats(fin, w2, hidden1 * hidden2, weight_path);
+        read_floats(fin, b2, hidden2, weight_path);
+        read_floats(fin, w3, hidden2 * hidden3, weight_path);
+        read_floats(fin, b3, hidden3, weight_path);
+        read_floats(fin, wv, hidden3, weight_path);
+        read_floats(fin, bv, 1, weight_path);
+        read_floats(fin, wp, hidden3 * BOARD_AREA, weight_path);
+        read_floats(fin, bp, BOARD_AREA, weight_path);
+        if (fin.peek() != EOF)
+        {
+            throw runtime_error("DNNEvaluatorNNUE: weight file is too long: " + weight_path);
+        }
+
+        feature_kernel.resize(n_features * hidden1);
+        feature_bias.resize(hidden1);
+        flip_kernel.resize(BOARD_AREA * hidden1);
+        for (int i = 0; i < n_features * hidden1; i++)
+        {
+            feature_kernel[i] = to_fixed(w1[i]);
+        }
+        for (int h = 0; h < hidden1; h++)
+        {
+            feature_bias[h] = to_fixed(b1[h]);
+        }
+        for (int pos = 0; pos < BOARD_AREA; pos++)
+        {
+            for (int h = 0; h < hidden1; h++)
+            {
+                flip_kernel[pos * hidden1 + h] = feature_kernel[(BOARD_AREA + pos) * hidden1 + h] - feature_kernel[pos * hidden1 + h];
+            }
+        }
+        dense2 = DenseInt8(w2.data(), b2.data(), hidden1, hidden2);
+        dense3 = DenseInt8(w3.data(), b3.data(), hidden2, hidden3);
+        value_dense = DenseInt8(wv.data(), bv.data(), hidden3, 1);
+        policy_dense = DenseInt8(wp.data(), bp.data(), hidden3, BOARD_AREA);
+    }
+
+    // 盤面からアキュムレータを作り直す
+    void refresh(const Board &board, NNUEAccumulator &acc) const
+    {
+        for (int player = 0; player < N_PLAYER; player++)
+        {
+            int16_t *values = acc.values[player];
+            memcpy(values, feature_bias.data(), hidden1 * sizeof(int16_t));
+            for (int side = 0; side < 2; side++)
+            {
+                for (BoardPlane bb = board.plane(side == 0 ? player : 1 - player); bb; bb &= bb - 1)
+                {
+                    add_feature(values, side * BOARD_AREA + __builtin_ctzll(bb));
+                }
+            }
+        }
+    }
+
+    // Board::do_moveの前のアキュムレータprevから、後のアキュムレータnextを求める。
+    // undo_info: do_moveが返したもの、board: do_moveの後の盤面。prevとnextは同じでもよい。
+    void update(const NNUEAccumulator &prev, const UndoInfo &undo_info, const Board &board, NNUEAccumulator &next) const
+    {
+        if (&prev != &next)
+        {
+            memcpy(&next, &prev, sizeof(NNUEAccumulator));
+        }
+        const Color mover = 1 - board.turn();
+        const BoardPlane flipped = undo_info.planes[1 - mover] & ~board.plane(1 - mover);
+        const BoardPlane placed = board.plane(mover) & ~undo_info.planes[mover] & ~flipped;
+        if (!placed)
+        {
+            return; // パス
+        }
+        const int pos = __builtin_ctzll(placed);
+        add_feature(next.values[mover], pos);
+        add_feature(next.values[1 - mover], BOARD_AREA + pos);
+        for (BoardPlane bb = flipped; bb; bb &= bb - 1)
+        {
+            // 着手側から見ると相手の石が自分の石に、相手側から見ると自分の石が相手の石になる
+            const int16_t *delta = &flip_kernel[__builtin_ctzll(bb) * hidden1];
+            int16_t *mover_values = next.values[mover], *opponent_values = next.values[1 - mover];
+            for (int h = 0; h < hidden1; h++)
+            {
+                mover_values[h] -= delta[h];
+                opponent_values[h] += delta[h];
+            }
+        }
+    }
+
+    // アキュムレータ(boardに対応するもの)から評価する
+    DNNEvaluatorResult evaluate(const Board &board, const NNUEAccumulator &acc) const
+    {
+        DNNEvaluatorResult res;
+        uint8_t h3[hidden3];
+        forward_hidden(board, acc, h3);
+        value_dense.forward(h3, &res.value_logit);
+        policy_dense.forward(h3, res.policy_logits);
+        return res;
+    }
+
+    // アキュムレータから価値だけを求める(方策の全結合を省く)
+    float evaluate_value(const Board &board, const NNUEAccumulator &acc) const
+    {
+        uint8_t h3[hidden3];
+        forward_hidden(board, acc, h3);
+        float value_logit;
+        value_dense.forward(h3, &value_logit);
+        return value_logit;
+    }
+
+    DNNEvaluatorResult evaluate(const Board &board)
+    {
+        NNUEAccumulator acc;
+        refresh(board, acc);
+        return evaluate(board, acc);
+    }
+
+    float evaluate_value(const Board &board)
+    {
+        NNUEAccumulator acc;
+        refresh(board, acc);
+        return evaluate_value(board, acc);
+    }
+
+private:
+    void add_feature(int16_t *values, int feature) const
+    {
+        const int16_t *w = &feature_kernel[feature * hidden1];
+        for (int h = 0; h < hidden1; h++)
+        {
+            values[h] += w[h];
+        }
+    }
+
+    // 第3層の出力(clipped ReLU適用後)を求める
+    void forward_hidden(const Board &board, const NNUEAccumulator &acc, uint8_t *h3) const
+    {
+        uint8_t h1[hidden1];
+        const int16_t *values = acc.values[board.turn()];
+        for (int h = 0; h < hidden1; h++)
+        {
+            h1[h] = static_cast<uint8_t>(min(max(int(values[h]), 0), INT8_ACTIVATION_MAX));
+        }
+        float y2[hidden2], y3[hidden3];
+        uint8_t h2[hidden2];
+        dense2.forward(h1, y2);
+        for (int h = 0; h < hidden2; h++)
+        {
+            h2[h] = clipped_relu(y2[h]);
+        }
+        dense3.forward(h2, y3);
+        for (int h = 0; h < hidden3; h++)
+        {
+            h3[h] = clipped_relu(y3[h]);
+        }
+    }
+};
+#endif
@@ -162,6 +162,25 @@ public:
     }
 
     DNNEvaluatorResult evaluate(const Board &board)
+    {
+        run(board);
+        DNNEvaluatorResult res;
+        memcpy(res.policy_logits, output_policy_handle->data, sizeof(res.policy_logits));
+        memcpy(&res.value_logit, output_value_handle->data, sizeof(res.value_logit));
+        return res;
+    }
+
+    // コンパイル済みのモデルは方策と価値を1回の呼び出しで計算するので、出力のうち価値だけを取り出す
+    float evaluate_value(const Board &board)
+    {
+        run(board);
+        float value_logit;
+        memcpy(&value_logit, output_value_handle->data, sizeof(value_logit));
+        return value_logit;
+    }
+
+private:
+    void run(const Board &board)
     {
         DNNInputFeature req = extractor.extract(board);
         memcpy(input_handle->data, req.board_repr, sizeof(req.board_repr));
@@ -176,10 +195,6 @@ public:
             cerr << "tvmgen_default_run failed" << endl;
             exit(1);
         }
-        DNNEvaluatorResult res;
-        memcpy(res.policy_logits, output_policy_handle->data, sizeof(res.policy_logits));
-        memcpy(&res.value_logit, output_value_handle->data, sizeof(res.value_logit));
-        return res;
     }
 };
 #endif
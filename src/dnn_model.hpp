@@ -0,0 +1,560 @@
+#ifndef _DNN_MODEL_
+#define _DNN_MODEL_
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include "dnn_conv.hpp"
+
+// 埋め込みDNNのモデル記述。層の接続、形状、重みを1つのバイナリにまとめたもので、othello_train/embed_weight.pyが出力する。
+// 評価器(DNNEvaluatorEmbedなど)は読み込み時に形状を見て各層の実装を選ぶので、チャンネル数や層数、残差接続の有無が異なるモデルを
+// ソースを書き換えずに使える。
+//
+// テンソルの番号: 0は入力(FeatureExtractorと同じ、盤面上の3チャンネル)、i + 1はi番目の層の出力。
+// テンソルは盤面上(BOARD_SIZE x BOARD_SIZE x チャンネル数)か、ベクトルのいずれか。
+//
+// バイナリの形式(すべてリトルエンディアン):
+//   ヘッダ: int32 x 6 = magic(DNN_MODEL_MAGIC), version(DNN_MODEL_VERSION), 層数, 方策の出力テンソル, 価値の出力テンソル, 重みの型(DNNModelDType)
+//   層ごと: int32 x 7 = 種類(DNNLayerType), 入力テンソル, 残差として足すテンソル(なければ-1), ReLUの有無, カーネルサイズ, 入力の大きさ, 出力の大きさ
+//           続いて重み(kernel_size()個)とバイアス(bias_size()個)。
+//           重みの型がDNN_DTYPE_INT8の場合、DNNLayerDesc::int8_weight()の層の重みは出力チャンネルごとの量子化の刻み
+//           (float32 x out_c)とint8(kernel_size()個、出力チャンネルは最後の軸)、バイアスはfloat32。それ以外の層は重み・バイアスともfloat32。
+// 方策の出力は1チャンネルの盤面、価値の出力は大きさ1のベクトルとする。
+const int32_t DNN_MODEL_MAGIC = 0x5748544F; // "OTHW"
+const int32_t DNN_MODEL_VERSION = 1;
+
+enum DNNModelDType
+{
+    DNN_DTYPE_FLOAT32 = 0,
+    DNN_DTYPE_BFLOAT16 = 1,
+    // 畳み込み層の重みを出力チャンネルごとに量子化したint8。int8の評価器(DNNEvaluatorEmbedInt8)は同じ刻みで量子化し直すので、
+    // int8で計算する層の誤差は増えない。floatで計算する層(全結合、出力チャンネル数の少ない畳み込みなど)はfloat32のまま。
+    DNN_DTYPE_INT8 = 2,
+};
+
+enum DNNLayerType
+{
+    // 盤面上の畳み込み(stride 1、出力サイズが入力と同じになるようpadding)。kernel: (ksize, ksize, in_c, out_c)、bias: (out_c)
+    DNN_LAYER_CONV2D = 1,
+    // 全結合。入力が盤面なら(BOARD_SIZE, BOARD_SIZE, チャンネル数)の順に平坦化したものを入力とする。kernel: (in_c, out_c)、bias: (out_c)
+    DNN_LAYER_DENSE = 2,
+    // 盤面上の要素ごとのバイアス。in_c = out_c = チャンネル数。kernel: (BOARD_SIZE, BOARD_SIZE, out_c)、biasはなし
+    DNN_LAYER_BOARD_BIAS = 3,
+};
+
+// 層の記述。残差接続がある場合、ReLUは残差を足した後に適用する。
+class DNNLayerDesc
+{
+public:
+    int type;
+    int input;
+    int residual;
+    bool relu;
+    int ksize;
+    int in_c;  // 入力の大きさ。畳み込みと要素ごとのバイアスは入力チャンネル数、全結合は平坦化した入力の要素数。
+    int out_c; // 出力の大きさ。盤面ならチャンネル数、ベクトルなら要素数。
+    vector<float> kernel;
+    vector<float> bias;
+
+    int kernel_size() const
+    {
+        switch (type)
+        {
+        case DNN_LAYER_CONV2D:
+            return ksize * ksize * in_c * out_c;
+        case DNN_LAYER_DENSE:
+            return in_c * out_c;
+        default:
+            return BOARD_AREA * out_c;
+        }
+    }
+
+    int bias_size() const
+    {
+        return type == DNN_LAYER_BOARD_BIAS ? 0 : out_c;
+    }
+
+    // 重みの型がDNN_DTYPE_INT8のとき、重みをint8で持つ層か。int8の評価器(DNNEvaluatorEmbedInt8)がint8で計算しうる、
+    // 量子化した入力を読む、ReLUを適用し残差接続のない、出力チャンネル数が8の倍数の畳み込みに限る。
+    bool int8_weight() const
+    {
+        return type == DNN_LAYER_CONV2D && input > 0 && relu && residual < 0 && out_c % 8 == 0;
+    }
+
+    // 出力が盤面上のテンソルか
+    bool board_output() const
+    {
+        return type != DNN_LAYER_DENSE;
+    }
+};
+
+#ifdef SIMD_X86
+// bfloat16_to_floatのAVX2実装。8要素ずつ16bitを32bitにゼロ拡張し、上位16bitに移す。nは8の倍数。
+TARGET_AVX2 inline void bfloat16_to_float_avx2(const uint8_t *src, float *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i += 8)
+    {
+        __m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_slli_epi32(bits, 16));
+    }
+}
+#endif
+
+// bfloat16(floatの上位16bit、リトルエンディアン)の配列をfloatに変換する
+inline void bfloat16_to_float(const uint8_t *src, float *dst, size_t n)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (cpu_has_avx2())
+    {
+        i = n / 8 * 8;
+        bfloat16_to_float_avx2(src, dst, i);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        uint32_t bits = (uint32_t(src[i * 2 + 1]) << 24) | (uint32_t(src[i * 2]) << 16);
+        memcpy(&dst[i], &bits, sizeof(float));
+    }
+}
+
+class DNNModelDesc
+{
+public:
+    vector<DNNLayerDesc> layers;
+    int policy_output;
+    int value_output;
+
+    DNNModelDesc() : policy_output(0), value_output(0)
+    {
+    }
+
+    int n_tensors() const
+    {
+        return layers.size() + 1;
+    }
+
+    bool is_board(int tensor) const
+    {
+        return tensor == 0 || layers[tensor - 1].board_output();
+    }
+
+    // 盤面ならチャンネル数、ベクトルなら要素数
+    int channels(int tensor) const
+    {
+        return tensor == 0 ? 3 : layers[tensor - 1].out_c;
+    }
+
+    // 1局面分のテンソルを、盤面なら周囲に0を加えた形式で保持するときの要素数
+    int buffer_size(int tensor) const
+    {
+        return is_board(tensor) ? PADDED_AREA * channels(tensor) : channels(tensor);
+    }
+
+    // outputsのテンソルを求めるのに必要な層の番号を、評価する順に返す
+    vector<int> required_layers(const vector<int> &outputs) const
+    {
+        vector<bool> required(n_tensors(), false);
+        for (int t : outputs)
+        {
+            required[t] = true;
+        }
+        // 層の入力は前の層の出力なので、後ろの層から順に必要なテンソルをたどる
+        for (int i = int(layers.size()) - 1; i >= 0; i--)
+        {
+            if (required[i + 1])
+            {
+                required[layers[i].input] = true;
+                if (layers[i].residual >= 0)
+                {
+                    required[layers[i].residual] = true;
+                }
+            }
+        }
+        vector<int> indices;
+        for (int i = 0; i < int(layers.size()); i++)
+        {
+            if (required[i + 1])
+            {
+                indices.push_back(i);
+            }
+        }
+        return indices;
+    }
+
+    static DNNModelDesc parse(const uint8_t *data, size_t size)
+    {
+        DNNModelDesc desc;
+        size_t pos = 0;
+        auto read_int = [&]()
+        {
+            if (pos + sizeof(int32_t) > size)
+            {
+                throw runtime_error("DNNModelDesc: unexpected end of data");
+            }
+            int32_t v;
+            memcpy(&v, data + pos, sizeof(v));
+            pos += sizeof(v);
+            return int(v);
+        };
+        if (read_int() != DNN_MODEL_MAGIC || read_int() != DNN_MODEL_VERSION)
+        {
+            throw runtime_error("DNNModelDesc: unsupported format");
+        }
+        int n_layers = read_int();
+        desc.policy_output = read_int();
+        desc.value_output = read_int();
+        int dtype = read_int();
+        if (dtype != DNN_DTYPE_FLOAT32 && dtype != DNN_DTYPE_BFLOAT16 && dtype != DNN_DTYPE_INT8)
+        {
+            throw runtime_error("DNNModelDesc: unsupported dtype");
+        }
+        auto read_floats = [&](vector<float> &dst, int n, int elem_dtype)
+        {
+            const size_t elem_size = elem_dtype == DNN_DTYPE_FLOAT32 ? sizeof(float) : elem_dtype == DNN_DTYPE_BFLOAT16 ? sizeof(uint16_t) : sizeof(int8_t);
+            if (pos + n * elem_size > size)
+            {
+                throw runtime_error("DNNModelDesc: unexpected end of data");
+            }
+            dst.resize(n);
+            if (n == 0)
+            {
+                return;
+            }
+            if (elem_dtype == DNN_DTYPE_FLOAT32)
+            {
+                memcpy(dst.data(), data + pos, n * sizeof(float));
+            }
+            else if (elem_dtype == DNN_DTYPE_BFLOAT16)
+            {
+                bfloat16_to_float(data + pos, dst.data(), n);
+            }
+            else
+            {
+                for (int j = 0; j < n; j++)
+                {
+                    dst[j] = float(int8_t(data[pos + j]));
+                }
+            }
+            pos += n * elem_size;
+        };
+        for (int i = 0; i < n_layers; i++)
+        {
+            DNNLayerDesc layer;
+            layer.type = read_int();
+            layer.input = read_int();
+            layer.residual = read_int();
+            layer.relu = read_int() != 0;
+            layer.ksize = read_int();
+            layer.in_c = read_int();
+            layer.out_c = read_int();
+            desc.layers.push_back(layer);
+            desc.validate_layer(i);
+            DNNLayerDesc &loaded = desc.layers[i];
+            if (dtype == DNN_DTYPE_INT8 && loaded.int8_weight())
+            {
+                vector<float> scales;
+                read_floats(scales, loaded.out_c, DNN_DTYPE_FLOAT32);
+                read_floats(loaded.kernel, loaded.kernel_size(), DNN_DTYPE_INT8);
+                for (int j = 0; j < loaded.kernel_size(); j++)
+                {
+                    loaded.kernel[j] *= scales[j % loaded.out_c];
+                }
+                read_floats(loaded.bias, loaded.bias_size(), DNN_DTYPE_FLOAT32);
+            }
+            else
+            {
+                const int layer_dtype = dtype == DNN_DTYPE_INT8 ? DNN_DTYPE_FLOAT32 : dtype;
+                read_floats(loaded.kernel, loaded.kernel_size(), layer_dtype);
+                read_floats(loaded.bias, loaded.bias_size(), layer_dtype);
+            }
+        }
+        if (pos != size)
+        {
+            throw runtime_error("DNNModelDesc: trailing data");
+        }
+        if (desc.policy_output <= 0 || desc.policy_output >= desc.n_tensors() || !desc.is_board(desc.policy_output) || desc.channels(desc.policy_output) != 1)
+        {
+            throw runtime_error("DNNModelDesc: invalid policy output");
+        }
+        if (desc.value_output <= 0 || desc.value_output >= desc.n_tensors() || desc.is_board(desc.value_output) || desc.channels(desc.value_output) != 1)
+        {
+            throw runtime_error("DNNModelDesc: invalid value output");
+        }
+        return desc;
+    }
+
+    static DNNModelDesc load_file(const string &path)
+    {
+        ifstream fin(path, ios::in | ios::binary);
+        if (!fin)
+        {
+            throw runtime_error("failed to open " + path);
+        }
+        vector<uint8_t> data((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+        return parse(data.data(), data.size());
+    }
+
+private:
+    // i番目の層の入力の形状が、前の層の出力と整合しているか確認する
+    void validate_layer(int i) const
+    {
+        const DNNLayerDesc &layer = layers[i];
+        const int output = i + 1;
+        if (layer.input < 0 || layer.input >= output || layer.residual < -1 || layer.residual >= output || layer.in_c <= 0 || layer.out_c <= 0 || layer.out_c > 4096)
+        {
+            throw runtime_error("DNNModelDesc: invalid connection at layer " + to_string(i));
+        }
+        bool ok = false;
+        switch (layer.type)
+        {
+        case DNN_LAYER_CONV2D:
+            ok = is_board(layer.input) && channels(layer.input) == layer.in_c && layer.ksize % 2 == 1 && layer.ksize / 2 <= (PADDED_SIZE - BOARD_SIZE) / 2;
+            break;
+        case DNN_LAYER_DENSE:
+            ok = layer.input != 0 && layer.in_c == (is_board(layer.input) ? BOARD_AREA : 1) * channels(layer.input);
+            break;
+        case DNN_LAYER_BOARD_BIAS:
+            ok = layer.input != 0 && is_board(layer.input) && channels(layer.input) == layer.in_c && layer.in_c == layer.out_c && layer.residual < 0;
+            break;
+        }
+        // 入力テンソルは盤面から直接計算する(BoardInputConv2D)ので、入力を使えるのは入力3チャンネルの畳み込みだけ
+        ok = ok && layer.residual != 0;
+        if (ok && layer.residual > 0)
+        {
+            ok = is_board(layer.residual) == layer.board_output() && channels(layer.residual) == layer.out_c;
+        }
+        if (!ok)
+        {
+            throw runtime_error("DNNModelDesc: invalid shape at layer " + to_string(i));
+        }
+    }
+};
+
+// 評価器で、モデル記述の1層をfloatで計算するもの。形状に合わせて実装を選んで構築する。
+// 入出力は、盤面ならn局面分の(PADDED_SIZE, PADDED_SIZE, チャンネル数)、ベクトルなら(n, 要素数)を続けて並べたもの。
+class DNNFloatLayer
+{
+public:
+    DNNLayerDesc desc; // kernelは構築後に不要なものを空にする
+
+private:
+    int board_input_c;           // 入力が盤面ならそのチャンネル数、ベクトルなら0
+    BoardInputConv2D input_conv; // 入力テンソルを読む畳み込み
+    BoardConv2D conv;
+    vector<float> dense_kernel; // 全結合の重みを(out_c, in_c)に転置したもの
+
+public:
+    DNNFloatLayer() : board_input_c(0)
+    {
+    }
+
+    // model.layers[index]を構築する
+    DNNFloatLayer(const DNNModelDesc &model, int index)
+        : desc(model.layers[index]), board_input_c(model.is_board(desc.input) ? model.channels(desc.input) : 0)
+    {
+        switch (desc.type)
+        {
+        case DNN_LAYER_CONV2D:
+            if (desc.input == 0)
+            {
+                input_conv = BoardInputConv2D(desc.kernel.data(), desc.bias.data(), desc.ksize, desc.out_c);
+            }
+            else
+            {
+                conv = BoardConv2D(desc.kernel.data(), desc.bias.data(), desc.ksize, desc.in_c, desc.out_c);
+            }
+            desc.kernel.clear();
+            break;
+        case DNN_LAYER_DENSE:
+            dense_kernel.resize(desc.in_c * desc.out_c);
+            for (int i = 0; i < desc.in_c; i++)
+            {
+                for (int o = 0; o < desc.out_c; o++)
+                {
+                    dense_kernel[o * desc.in_c + i] = desc.kernel[i * desc.out_c + o];
+                }
+            }
+            desc.kernel.clear();
+            break;
+        }
+    }
+
+    // 入力テンソルを盤面から直接計算する場合に必要な作業領域の要素数
+    int work_size() const
+    {
+        return desc.type == DNN_LAYER_CONV2D && desc.input == 0 ? BOARD_AREA * desc.out_c : 0;
+    }
+
+    // 入力テンソルを読む畳み込みの出力を、周囲を加えない(BOARD_AREA, out_c)の形式で求める。ReLUは適用しない。
+    void forward_input(const Board &board, float *y) const
+    {
+        input_conv.forward_dense(board, y);
+    }
+
+    // boards: 入力テンソルを読む層で使う盤面。x: 入力テンソル、residual: 残差のテンソル(なければnullptr)
+    void forward(const Board *boards, const float *x, const float *residual, float *y, int n, float *work) const
+    {
+        const bool fused_relu = desc.relu && !residual;
+        switch (desc.type)
+        {
+        case DNN_LAYER_CONV2D:
+            if (desc.input == 0)
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    input_conv.forward(boards[i], y + i * PADDED_AREA * desc.out_c, work, fused_relu);
+                }
+            }
+            else
+            {
+                conv.forward(x, y, n, fused_relu);
+            }
+            break;
+        case DNN_LAYER_DENSE:
+            forward_dense(x, y, n, fused_relu);
+            break;
+        case DNN_LAYER_BOARD_BIAS:
+            forward_board_bias(x, y, n, fused_relu);
+            break;
+        }
+        if (residual)
+        {
+            add_residual(residual, y, n);
+        }
+    }
+
+private:
+    // 入力が盤面なら、周囲を除いた行ごとに連続する部分を重みと掛ける
+    void forward_dense(const float *x, float *y, int n, bool relu) const
+    {
+        const int ch = board_input_c;
+        for (int i = 0; i < n; i++)
+        {
+            for (int o = 0; o < desc.out_c; o++)
+            {
+                const float *k = &dense_kernel[o * desc.in_c];
+                float sum = desc.bias[o];
+                if (ch > 0)
+                {
+                    const float *xi = x + i * PADDED_AREA * ch;
+                    for (int row = 0; row < BOARD_SIZE; row++)
+                    {
+                        const float *x_row = xi + ((row + 1) * PADDED_SIZE + 1) * ch;
+                        const float *k_row = k + row * BOARD_SIZE * ch;
+                        for (int j = 0; j < BOARD_SIZE * ch; j++)
+                        {
+                            sum += x_row[j] * k_row[j];
+                        }
+                    }
+                }
+                else
+                {
+                    const float *xi = x + i * desc.in_c;
+                    for (int j = 0; j < desc.in_c; j++)
+                    {
+                        sum += xi[j] * k[j];
+                    }
+                }
+                y[i * desc.out_c + o] = relu ? max(sum, 0.0F) : sum;
+            }
+        }
+    }
+
+    void forward_board_bias(const float *x, float *y, int n, bool relu) const
+    {
+        const int ch = desc.out_c;
+        for (int i = 0; i < n; i++)
+        {
+            for (int row = 0; row < BOARD_SIZE; row++)
+            {
+                const int offset = (i * PADDED_AREA + (row + 1) * PADDED_SIZE + 1) * ch;
+                const float *k_row = &desc.kernel[row * BOARD_SIZE * ch];
+                for (int j = 0; j < BOARD_SIZE * ch; j++)
+                {
+                    float v = x[offset + j] + k_row[j];
+                    y[offset + j] = relu ? max(v, 0.0F) : v;
+                }
+            }
+        }
+    }
+
+    void add_residual(const float *residual, float *y, int n) const
+    {
+        if (!desc.board_output())
+        {
+            for (int j = 0; j < n * desc.out_c; j++)
+            {
+                float v = y[j] + residual[j];
+                y[j] = desc.relu ? max(v, 0.0F) : v;
+            }
+            return;
+        }
+        const int ch = desc.out_c;
+        for (int i = 0; i < n; i++)
+        {
+            for (int row = 0; row < BOARD_SIZE; row++)
+            {
+                const int offset = (i * PADDED_AREA + (row + 1) * PADDED_SIZE + 1) * ch;
+                for (int j = 0; j < BOARD_SIZE * ch; j++)
+                {
+                    float v = y[offset + j] + residual[offset + j];
+                    y[offset + j] = desc.relu ? max(v, 0.0F) : v;
+                }
+            }
+        }
+    }
+};
+
+// テンソルごとに、評価で使うバッファの番号を割り当てる。同じ大きさで生存期間が重ならないテンソルは同じバッファを共有する。
+// 盤面のテンソルは周囲の0を保つ必要があるので、チャンネル数が同じ盤面のテンソルとだけ共有する。
+// テンソルt(1以上)のバッファ番号をtensor_buffer[t]に、各バッファの1局面分の要素数をbuffer_sizesに格納する。入力テンソル(0)は-1。
+inline void assign_tensor_buffers(const DNNModelDesc &desc, vector<int> &tensor_buffer, vector<int> &buffer_sizes)
+{
+    const int n_tensors = desc.n_tensors();
+    // テンソルを最後に読む層の番号。出力テンソルは評価の最後まで残す。
+    vector<int> last_use(n_tensors, -1);
+    for (int i = 0; i < int(desc.layers.size()); i++)
+    {
+        last_use[desc.layers[i].input] = i;
+        if (desc.layers[i].residual >= 0)
+        {
+            last_use[desc.layers[i].residual] = i;
+        }
+    }
+    last_use[desc.policy_output] = last_use[desc.value_output] = n_tensors;
+
+    tensor_buffer.assign(n_tensors, -1);
+    buffer_sizes.clear();
+    vector<bool> buffer_board;
+    vector<int> free_buffers;
+    for (int i = 0; i < int(desc.layers.size()); i++)
+    {
+        const int t = i + 1;
+        const int size = desc.buffer_size(t);
+        const bool board = desc.is_board(t);
+        auto it = find_if(free_buffers.begin(), free_buffers.end(), [&](int b)
+                          { return buffer_sizes[b] == size && buffer_board[b] == board; });
+        if (it != free_buffers.end())
+        {
+            tensor_buffer[t] = *it;
+            free_buffers.erase(it);
+        }
+        else
+        {
+            tensor_buffer[t] = buffer_sizes.size();
+            buffer_sizes.push_back(size);
+            buffer_board.push_back(board);
+        }
+        // 出力のバッファを決めてから解放するので、入力と出力が同じバッファになることはない
+        for (int u : {desc.layers[i].input, desc.layers[i].residual, t})
+        {
+            if (u > 0 && last_use[u] <= i && find(free_buffers.begin(), free_buffers.end(), tensor_buffer[u]) == free_buffers.end())
+            {
+                free_buffers.push_back(tensor_buffer[u]);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,132 @@
+#ifndef _ENDGAME_SOLVER_
+#define _ENDGAME_SOLVER_
+#include <climits>
+#include "board.hpp"
+
+// 終盤の完全読み。空きマスが少ない局面の勝敗(WLD)をアルファベータ法で確定させる。
+class EndgameSolver
+{
+    // 空きマスがこの数以上のとき、相手の着手可能数が少ない順に指し手を並べ替える(速さ優先探索)
+    static const int ordering_min_empties = 6;
+
+    long long node_limit; // node_countがこの値に達したら探索を打ち切る
+    bool aborted;
+
+public:
+    // 探索を打ち切った場合のsolve_wldの戻り値
+    static const int SOLVE_ABORTED = 2;
+    long long node_count; // 探索したノード数
+
+    EndgameSolver() : node_limit(0), aborted(false), node_count(0)
+    {
+    }
+
+    // 手番側から見た勝敗を返す。勝ち=1、負け=-1、引き分け=0。
+    // max_nodesが正なら、探索ノード数がそれを超えた時点で打ち切り、SOLVE_ABORTEDを返す。
+    int solve_wld(Board &b, long long max_nodes = 0)
+    {
+        node_limit = max_nodes > 0 ? node_count + max_nodes : LLONG_MAX;
+        aborted = false;
+        int result = solve(b, -1, 1);
+        return aborted ? SOLVE_ABORTED : result;
+    }
+
+private:
+    int final_score(const Board &b) const
+    {
+        int diff = b.count_stone_diff();
+        return diff > 0 ? 1 : (diff < 0 ? -1 : 0);
+    }
+
+    // 打ち切った場合(abortedがtrue)の戻り値は意味を持たない
+    int solve(Board &b, int alpha, int beta)
+    {
+        if (++node_count > node_limit)
+        {
+            aborted = true;
+            return 0;
+        }
+        BoardPlane moves;
+        b.legal_moves_bb(moves);
+        if (!moves)
+        {
+            UndoInfo undo_info;
+            b.do_move(MOVE_PASS, undo_info);
+            BoardPlane opponent_moves;
+            b.legal_moves_bb(opponent_moves);
+            int score;
+            if (!opponent_moves)
+            {
+                // 両者とも打てないので終局
+                score = -final_score(b);
+            }
+            else
+            {
+                score = -solve(b, -beta, -alpha);
+            }
+            b.undo_move(undo_info);
+            return score;
+        }
+
+        Move move_list[BOARD_AREA];
+        int n_moves = 0;
+        int empties = BOARD_AREA - b.piece_sum();
+        if (empties >= ordering_min_empties)
+        {
+            int mobility[BOARD_AREA];
+            for (BoardPlane bb = moves; bb; bb &= bb - 1)
+            {
+                Move move = __builtin_ctzll(bb);
+                UndoInfo undo_info;
+                b.do_move(move, undo_info);
+                BoardPlane opponent_moves;
+                b.legal_moves_bb(opponent_moves);
+                b.undo_move(undo_info);
+                // 挿入ソート
+                int m = __builtin_popcountll(opponent_moves);
+                int i = n_moves++;
+                for (; i > 0 && mobility[i - 1] > m; i--)
+                {
+                    mobility[i] = mobility[i - 1];
+                    move_list[i] = move_list[i - 1];
+                }
+                mobility[i] = m;
+                move_list[i] = move;
+            }
+        }
+        else
+        {
+            for (BoardPlane bb = moves; bb; bb &= bb - 1)
+            {
+                move_list[n_moves++] = __builtin_ctzll(bb);
+            }
+        }
+
+        int best = -2;
+        for (int i = 0; i < n_moves; i++)
+        {
+            UndoInfo undo_info;
+            b.do_move(move_list[i], undo_info);
+            int score = -solve(b, -beta, -alpha);
+            b.undo_move(undo_info);
+            if (aborted)
+            {
+                return 0;
+            }
+            if (score > best)
+            {
+                best = score;
+                if (best > alpha)
+                {
+                    alpha = best;
+                    if (alpha >= beta)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+        return best;
+    }
+};
+#endif
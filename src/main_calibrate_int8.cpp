@@ -0,0 +1,143 @@
+// DNNEvaluatorEmbedInt8のキャリブレーションと精度の確認
+// 棋譜(MoveRecord形式)の局面を埋め込みDNN(float)で評価して各活性の最大値を求め、キャリブレーションファイルに保存する。
+// 棋譜の局面を交互にキャリブレーション用と検証用に分け、検証用の局面でint8版とfloat版の出力を比較する。
+// usage: calibrate_int8 record_path calibration_path [n_positions]
+
+#include "common.hpp"
+#include "selfplay.hpp"
+#include "dnn_evaluator_embed_int8.hpp"
+
+vector<Board> read_record_boards(const string &record_path, int n_positions)
+{
+    ifstream fin(record_path, ios::in | ios::binary);
+    if (!fin)
+    {
+        cerr << "failed to open " << record_path << endl;
+        exit(1);
+    }
+    vector<Board> boards;
+    MoveRecord record;
+    while (int(boards.size()) < n_positions && fin.read(reinterpret_cast<char *>(&record), sizeof(record)))
+    {
+        Board board;
+        board.set_pybind11(record.planes[BLACK], record.planes[WHITE], Color(record.turn));
+        boards.push_back(board);
+    }
+    return boards;
+}
+
+template <class F>
+double measure_seconds_per_call(int n, F f)
+{
+    auto start_time = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        f(i);
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start_time).count() / n;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "usage: calibrate_int8 record_path calibration_path [n_positions]" << endl;
+        return 1;
+    }
+    string record_path = argv[1];
+    string calibration_path = argv[2];
+    int n_positions = argc >= 4 ? atoi(argv[3]) : 10000;
+
+    vector<Board> boards = read_record_boards(record_path, n_positions);
+    vector<Board> calibration_boards, test_boards;
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+        (i % 2 == 0 ? calibration_boards : test_boards).push_back(boards[i]);
+    }
+    if (test_boards.empty())
+    {
+        cerr << "too few positions in " << record_path << endl;
+        return 1;
+    }
+    cerr << "calibration " << calibration_boards.size() << " positions, test " << test_boards.size() << " positions" << endl;
+
+    DNNEvaluatorEmbed float_evaluator;
+    vector<float> layer_max(float_evaluator.get_model().layers.size(), 0.0F);
+    vector<DNNEvaluatorResult> float_results(boards.size());
+    float_evaluator.accumulate_activation_max(calibration_boards.data(), float_results.data(), calibration_boards.size(), layer_max.data());
+    save_int8_calibration(calibration_path, layer_max);
+    for (size_t i = 0; i < layer_max.size(); i++)
+    {
+        cerr << "layer " << i << " max " << layer_max[i] << endl;
+    }
+
+    DNNEvaluatorEmbedInt8 int8_evaluator(float_evaluator, layer_max);
+    int n_test = test_boards.size();
+    vector<DNNEvaluatorResult> int8_results(n_test);
+    double float_time = measure_seconds_per_call(n_test, [&](int i)
+                                                 { float_results[i] = float_evaluator.evaluate(test_boards[i]); });
+    double int8_time = measure_seconds_per_call(n_test, [&](int i)
+                                                { int8_results[i] = int8_evaluator.evaluate(test_boards[i]); });
+    // 価値だけを求める場合(方策の出力を省く)
+    vector<float> float_values(n_test), int8_values(n_test);
+    double float_value_time = measure_seconds_per_call(n_test, [&](int i)
+                                                       { float_values[i] = float_evaluator.evaluate_value(test_boards[i]); });
+    double int8_value_time = measure_seconds_per_call(n_test, [&](int i)
+                                                      { int8_values[i] = int8_evaluator.evaluate_value(test_boards[i]); });
+    for (int i = 0; i < n_test; i++)
+    {
+        if (float_values[i] != float_results[i].value_logit || int8_values[i] != int8_results[i].value_logit)
+        {
+            cerr << "evaluate_value does not match evaluate" << endl;
+            return 1;
+        }
+    }
+
+    // 方策は合法手のlogitだけを比較する(非合法手は探索で使われない)
+    double value_max_error = 0.0, value_sum_error = 0.0, policy_max_error = 0.0, policy_sum_error = 0.0;
+    long long n_policy = 0;
+    int n_top1_match = 0, n_has_move = 0;
+    for (int i = 0; i < n_test; i++)
+    {
+        const auto &expect = float_results[i], &actual = int8_results[i];
+        double value_error = abs(expect.value_logit - actual.value_logit);
+        value_max_error = max(value_max_error, value_error);
+        value_sum_error += value_error;
+
+        vector<Move> legal_moves;
+        test_boards[i].legal_moves(legal_moves);
+        if (legal_moves.empty())
+        {
+            continue;
+        }
+        Move expect_best = legal_moves[0], actual_best = legal_moves[0];
+        for (Move move : legal_moves)
+        {
+            double policy_error = abs(expect.policy_logits[move] - actual.policy_logits[move]);
+            policy_max_error = max(policy_max_error, policy_error);
+            policy_sum_error += policy_error;
+            n_policy++;
+            if (expect.policy_logits[move] > expect.policy_logits[expect_best])
+            {
+                expect_best = move;
+            }
+            if (actual.policy_logits[move] > actual.policy_logits[actual_best])
+            {
+                actual_best = move;
+            }
+        }
+        n_has_move++;
+        if (expect_best == actual_best)
+        {
+            n_top1_match++;
+        }
+    }
+
+    cout << "value_logit error: max " << value_max_error << " mean " << value_sum_error / n_test << endl;
+    cout << "policy_logits error (legal moves): max " << policy_max_error << " mean " << (n_policy ? policy_sum_error / n_policy : 0.0) << endl;
+    cout << "policy top-1 agreement: " << n_top1_match << " / " << n_has_move << endl;
+    cout << "time per evaluation: float " << float_time * 1e6 << "us int8 " << int8_time * 1e6 << "us" << endl;
+    cout << "time per value evaluation: float " << float_value_time * 1e6 << "us int8 " << int8_value_time * 1e6 << "us" << endl;
+
+    return 0;
+}
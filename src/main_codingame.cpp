@@ -16,16 +16,30 @@ int main()
         return 1;
     }
 
-    shared_ptr<DNNEvaluator> evaluator(new DNNEvaluatorTVM());
+    // 前の手の探索で評価した局面を再評価しないようキャッシュする
+    DNNEvaluatorCached::DNNEvaluatorCachedConfig cache_config;
+    cache_config.memory_budget_bytes = 64 * 1024 * 1024;
+    cache_config.use_symmetry = false;
+    shared_ptr<DNNEvaluator> evaluator(new DNNEvaluatorCached(shared_ptr<DNNEvaluator>(new DNNEvaluatorTVM()), cache_config));
     SearchMCTS::SearchMCTSConfig mcts_config;
     mcts_config.playout_limit = 4096;
     mcts_config.table_size = mcts_config.playout_limit * 60 * 2;
     mcts_config.c_puct = 1.0;
-    mcts_config.time_limit_ms = 120; // 本番用
-    // mcts_config.time_limit_ms = 1000; // 強さ測定用
+    // ルール上の制限時間は初手1000ms、以降150ms。初手は評価器の初期化時間も含まれるため短めにする。
+    mcts_config.time_config.turn_limit_ms = 150;
+    mcts_config.time_config.first_turn_limit_ms = 800;
+    mcts_config.time_config.margin_ms = 30;
+    mcts_config.time_config.game_limit_ms = 0;
+    mcts_config.time_config.soft_ratio = 0.5; // 本番用
+    // mcts_config.time_config.soft_ratio = 1.0; // 強さ測定用(毎手制限時間まで探索)
+    mcts_config.time_config.max_extension = 1.5;
+    mcts_config.time_config.time_bank = true; // 最善手が早く決まった手で余った時間を、不安定な手の延長に回す
     mcts_config.mate_1ply = true;
     mcts_config.select_move_proportional_until_move = 0; // 本番用
     // mcts_config.select_move_proportional_until_move = 20; // 強さ測定用
+    mcts_config.endgame_solve_empties = 12;
+    mcts_config.endgame_solve_max_nodes = 5000; // 約0.5ms。空き12マスでは3割程度の局面が打ち切られる
+    mcts_config.ponder = false; // 相手番の間はほぼ計算できない(feature_check/ponder_check.cpp)
     SearchBase *ai = new SearchMCTS(mcts_config, evaluator);
     ai->newgame();
     // game loop
@@ -39,6 +53,7 @@ int main()
             cin.ignore();
             if (cin.eof())
             {
+                ai->stop_ponder();
                 return 0;
             }
             position_lines.push_back(line);
@@ -60,5 +75,6 @@ int main()
         string msg;
         Move bestmove = ai->search(msg);
         cout << move_to_str(bestmove) << " MSG " << msg << endl; // a-h1-8
+        ai->start_ponder();
     }
 }
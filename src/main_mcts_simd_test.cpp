@@ -0,0 +1,142 @@
+#include "common.hpp"
+
+// MCTSの子ノード選択(select_edge)と評価結果の割り当て(assign_eval_result)について、
+// AVX2実装の結果がスカラー実装と一致するかテストする。
+// 乱数で作ったノードで比較する。浮動小数点の計算順序やexpの近似による差は許容する。
+
+#ifdef SIMD_X86
+// 指し手を選んだ場合のスコア(select_edge_scalarと同じ計算)
+float edge_score(const TreeNode &node, int edge, float c_puct)
+{
+    float n_sum_sqrt = sqrt(static_cast<float>(node.value_n_sum)) + 0.001;
+    float u = node.value_p[edge] / static_cast<float>(node.value_n[edge] + 1) * n_sum_sqrt * c_puct;
+    float q = node.value_n[edge] == 0 ? node.score : (node.value_w[edge] / static_cast<float>(node.value_n[edge]));
+    return u + q;
+}
+
+void make_random_node(mt19937 &engine, TreeNode &node)
+{
+    node.clear();
+    uniform_real_distribution<float> unit(0.0F, 1.0F);
+    node.n_legal_moves = engine() % MAX_LEGAL_MOVES + 1;
+    node.score = unit(engine) * 2.0F - 1.0F;
+    // 訪問回数は、未訪問の指し手が多い場合と、多数訪問済みの場合の両方を作る
+    int max_visits = engine() % 2 ? 4 : 1000;
+    vector<int> positions(BOARD_AREA);
+    for (int i = 0; i < BOARD_AREA; i++)
+    {
+        positions[i] = i;
+    }
+    shuffle(positions.begin(), positions.end(), engine);
+    float p_sum = 0.0F;
+    for (int i = 0; i < node.n_legal_moves; i++)
+    {
+        node.move_list[i] = static_cast<uint8_t>(positions[i]);
+        node.value_n[i] = engine() % (max_visits + 1);
+        node.value_w[i] = (unit(engine) * 2.0F - 1.0F) * node.value_n[i];
+        node.value_p[i] = unit(engine);
+        p_sum += node.value_p[i];
+        node.edge_proven[i] = engine() % 8 == 0 ? PROVEN_LOSS : PROVEN_NONE;
+        node.value_n_sum += node.value_n[i];
+    }
+    for (int i = 0; i < node.n_legal_moves; i++)
+    {
+        node.value_p[i] /= p_sum;
+    }
+}
+
+// 選んだ指し手が異なっても、スコアが誤差の範囲で同じなら一致とみなす
+bool check_select_edge(const TreeNode &node, float c_puct)
+{
+    int expect = MCTSBase::select_edge_scalar(&node, c_puct);
+    int actual = MCTSBase::select_edge_avx2(&node, c_puct);
+    if (expect == actual)
+    {
+        return true;
+    }
+    if (node.edge_proven[expect] == PROVEN_LOSS || node.edge_proven[actual] == PROVEN_LOSS)
+    {
+        // 負けが証明された指し手を選ぶのは、すべての指し手が負けの場合(いずれも先頭の指し手を返す)のみ
+        cout << "select_edge: expected " << expect << ", actual " << actual << endl;
+        return false;
+    }
+    float expect_score = edge_score(node, expect, c_puct);
+    float actual_score = edge_score(node, actual, c_puct);
+    if (abs(expect_score - actual_score) > 1e-5F * max(1.0F, abs(expect_score)))
+    {
+        cout << "select_edge: expected " << expect << " (score " << expect_score << "), actual " << actual << " (score " << actual_score << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool check_assign_eval_result(mt19937 &engine, const TreeNode &node)
+{
+    uniform_real_distribution<float> logit_dist(-10.0F, 10.0F);
+    float policy_logits[BOARD_AREA];
+    for (int i = 0; i < BOARD_AREA; i++)
+    {
+        policy_logits[i] = logit_dist(engine);
+    }
+    float value_logit = logit_dist(engine);
+    TreeNode expect = node, actual = node;
+    MCTSBase::assign_eval_result_scalar(&expect, policy_logits, value_logit);
+    MCTSBase::assign_eval_result_avx2(&actual, policy_logits, value_logit);
+    if (abs(expect.score - actual.score) > 1e-5F)
+    {
+        cout << "assign_eval_result: score " << expect.score << " != " << actual.score << endl;
+        return false;
+    }
+    for (int i = 0; i < node.n_legal_moves; i++)
+    {
+        if (abs(expect.value_p[i] - actual.value_p[i]) > 1e-5F)
+        {
+            cout << "assign_eval_result: value_p[" << i << "] " << expect.value_p[i] << " != " << actual.value_p[i] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+int main()
+{
+#ifdef SIMD_X86
+    if (!cpu_has_avx2())
+    {
+        cout << "AVX2 is not supported on this CPU" << endl;
+        return 0;
+    }
+    const int n_cases = 10000;
+    const float c_puct = 1.0F;
+    mt19937 engine(1);
+    int ok = 0;
+    for (int i = 0; i < n_cases; i++)
+    {
+        TreeNode node;
+        make_random_node(engine, node);
+        bool success = check_select_edge(node, c_puct);
+        // 指し手が1つの場合はassign_eval_resultがSIMD実装を使わない
+        if (node.n_legal_moves >= 2)
+        {
+            success = check_assign_eval_result(engine, node) && success;
+        }
+        if (success)
+        {
+            ok++;
+        }
+        else
+        {
+            cout << "In case " << i << " (n_legal_moves " << node.n_legal_moves << ")" << endl;
+        }
+    }
+
+    cout << n_cases << " cases, " << ok << " passed, " << (n_cases - ok) << " failed" << endl;
+
+    return n_cases == ok ? 0 : 1;
+#else
+    // -DNO_SIMDでビルドした場合やx86以外ではAVX2実装がないので、テストしない
+    cout << "AVX2 is not supported on this platform" << endl;
+    return 0;
+#endif
+}
@@ -32,9 +32,18 @@ int main(int argc, char *argv[])
     }
     mcts_config.table_size = mcts_config.playout_limit * 2;
     mcts_config.c_puct = 1.0;
-    mcts_config.time_limit_ms = 1000;
+    mcts_config.time_config.turn_limit_ms = 1000;
+    mcts_config.time_config.first_turn_limit_ms = 1000;
+    mcts_config.time_config.margin_ms = 0;
+    mcts_config.time_config.game_limit_ms = 0;
+    mcts_config.time_config.soft_ratio = 1.0;
+    mcts_config.time_config.max_extension = 1.0;
+    mcts_config.time_config.time_bank = false;
     mcts_config.mate_1ply = true;
     mcts_config.select_move_proportional_until_move = 10;
+    mcts_config.endgame_solve_empties = 0; // DNNの評価を可視化するため、完全読みは使わない
+    mcts_config.endgame_solve_max_nodes = 0;
+    mcts_config.ponder = false; // 入力局面は互いに無関係なので、ponderしても再利用できない
     SearchMCTS *ai = new SearchMCTS(mcts_config, evaluator);
     ai->newgame();
 
@@ -3,15 +3,28 @@
 int main()
 {
     const int n_games = 100;
-    //shared_ptr<DNNEvaluator> evaluator(new DNNEvaluatorSocket("127.0.0.1", 8099));
-    shared_ptr<DNNEvaluator> evaluator(new DNNEvaluatorEmbed());
+    //shared_ptr<DNNEvaluator> base_evaluator(new DNNEvaluatorSocket("127.0.0.1", 8099));
+    shared_ptr<DNNEvaluator> base_evaluator(new DNNEvaluatorEmbed());
+    DNNEvaluatorCached::DNNEvaluatorCachedConfig cache_config;
+    cache_config.memory_budget_bytes = 64 * 1024 * 1024;
+    cache_config.use_symmetry = false;
+    shared_ptr<DNNEvaluatorCached> evaluator(new DNNEvaluatorCached(base_evaluator, cache_config));
     SearchMCTS::SearchMCTSConfig mcts_config;
     mcts_config.playout_limit = 16;
     mcts_config.table_size = mcts_config.playout_limit * 60 * 2;
     mcts_config.c_puct = 1.0;
-    mcts_config.time_limit_ms = 1000;
+    mcts_config.time_config.turn_limit_ms = 1000;
+    mcts_config.time_config.first_turn_limit_ms = 1000;
+    mcts_config.time_config.margin_ms = 0;
+    mcts_config.time_config.game_limit_ms = 0;
+    mcts_config.time_config.soft_ratio = 1.0;
+    mcts_config.time_config.max_extension = 1.0;
+    mcts_config.time_config.time_bank = false;
     mcts_config.mate_1ply = true;
     mcts_config.select_move_proportional_until_move = 10;
+    mcts_config.endgame_solve_empties = 12;
+    mcts_config.endgame_solve_max_nodes = 5000;
+    mcts_config.ponder = true; // 評価器はスレッドセーフではないため、同じ評価器を共有する複数のエンジンでponderしないこと
     SearchBase *ais[] = {new SearchRandom(), new SearchMCTS(mcts_config, evaluator)};
     int player_win_count[N_PLAYER] = {0};
     int color_win_count[N_PLAYER] = {0};
@@ -36,6 +49,7 @@ int main()
             ai->board.set(board);
             string msg;
             Move move = ai->search(msg);
+            ai->start_ponder();
 
             UndoInfo undo_info;
             board.do_move(move, undo_info);
@@ -63,6 +77,7 @@ int main()
     cout << "Summary" << endl;
     cout << ais[0]->name() << " - " << ais[1]->name() << " : " << player_win_count[0] << " - " << draw_count << " - " << player_win_count[1] << endl;
     cout << "black - white : " << color_win_count[0] << " - " << color_win_count[1] << endl;
+    cout << "evaluator " << evaluator->stats_string() << endl;
 
     return 0;
 }
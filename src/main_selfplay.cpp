@@ -0,0 +1,93 @@
+#include "common.hpp"
+#include "selfplay.hpp"
+
+// Python/TensorFlowを使わず、埋め込みDNNで自己対局して棋譜(playout_v1.pyと同じMoveRecord形式)を生成する
+// usage: selfplay record_path games [playout_limit] [parallel] [pending_per_game] [n_threads] [fast_playout_limit] [full_search_prob]
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "usage: selfplay record_path games [playout_limit] [parallel] [pending_per_game] [n_threads] [fast_playout_limit] [full_search_prob]" << endl;
+        return 1;
+    }
+    string record_path = argv[1];
+    int games = atoi(argv[2]);
+    int playout_limit = argc >= 4 ? atoi(argv[3]) : 64;
+    int parallel = argc >= 5 ? atoi(argv[4]) : 64;
+    int pending_per_game = argc >= 6 ? atoi(argv[5]) : 1;
+    int n_threads = argc >= 7 ? atoi(argv[6]) : int(thread::hardware_concurrency());
+    n_threads = max(n_threads, 1);
+    // playout cap randomization: 既定では無効(常にplayout_limit回探索)
+    int fast_playout_limit = argc >= 8 ? atoi(argv[7]) : playout_limit;
+    float full_search_prob = argc >= 9 ? float(atof(argv[8])) : 1.0F;
+
+    shared_ptr<ofstream> fout(new ofstream());
+    fout->open(record_path, ios::out | ios::binary | ios::trunc);
+    if (!*fout)
+    {
+        cerr << "failed to open " << record_path << endl;
+        return 1;
+    }
+
+    auto mcts_config = make_selfplay_mcts_config(playout_limit, pending_per_game, fast_playout_limit, full_search_prob);
+    ParallelPlayout playout(fout, mcts_config, parallel, n_threads, 1);
+
+    // 評価器はスレッドセーフではないので、評価を分担するスレッドごとに用意する
+    vector<shared_ptr<DNNEvaluator>> evaluators;
+    for (int i = 0; i < n_threads; i++)
+    {
+        auto evaluator = new DNNEvaluatorEmbed();
+        if (i == 0)
+        {
+            const auto &startup_time = evaluator->get_startup_time();
+            cerr << "evaluator startup: decode " << startup_time.decode_us << "us, parse " << startup_time.parse_us << "us, plan " << startup_time.plan_us << "us" << endl;
+        }
+        evaluators.push_back(shared_ptr<DNNEvaluator>(evaluator));
+    }
+
+    int capacity = playout.group_capacity(0);
+    vector<float> board_repr(capacity * sizeof(DNNInputFeature::board_repr) / sizeof(float));
+    vector<float> policy_logits(capacity * BOARD_AREA);
+    vector<float> value_logit(capacity);
+    vector<Board> boards(capacity);
+    vector<DNNEvaluatorResult> results(capacity);
+
+    auto start_time = chrono::steady_clock::now();
+    long long evaluated = 0;
+    int last_reported = 0;
+    while (playout.games_completed() < games)
+    {
+        int n = playout.proceed(0, board_repr.data(), policy_logits.data(), value_logit.data());
+        for (int i = 0; i < n; i++)
+        {
+            boards[i] = playout.batch_board(0, i);
+        }
+        // バッチをスレッド数に分割して評価する
+        playout.get_thread_pool().parallel_for(n_threads, [&](int t)
+                                               {
+                                                   int begin = n * t / n_threads, end = n * (t + 1) / n_threads;
+                                                   if (begin < end)
+                                                   {
+                                                       evaluators[t]->evaluate_batch(&boards[begin], &results[begin], end - begin);
+                                                   } });
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(&policy_logits[i * BOARD_AREA], results[i].policy_logits, sizeof(results[i].policy_logits));
+            value_logit[i] = results[i].value_logit;
+        }
+        evaluated += n;
+
+        int completed = playout.games_completed();
+        if (completed / 100 != last_reported / 100)
+        {
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+            cerr << "games " << completed << " evaluated " << evaluated << " elapsed " << elapsed << "s" << endl;
+        }
+        last_reported = completed;
+    }
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    cout << "games " << playout.games_completed() << " evaluated " << evaluated << " elapsed " << elapsed << "s" << endl;
+
+    return 0;
+}
@@ -1,12 +1,23 @@
 #ifndef _MCTS_UTIL_
 #define _MCTS_UTIL_
 
+#include <cassert>
 #include "search_base.hpp"
+#include "simd_util.hpp"
+
+// 探索で証明された勝敗。手番側から見た結果。
+enum ProvenResult : int8_t
+{
+    PROVEN_NONE = 0, // 未証明
+    PROVEN_WIN,
+    PROVEN_LOSS,
+    PROVEN_DRAW,
+};
 
 // 置換表のノード
 class TreeNode
 {
-    // 552バイト
+    // 592バイト
 public:
     float score;                        // 静的評価値（ゲーム終了なら手番側の勝ちで+1、負けで-1、引き分けで0）
     int n_legal_moves;                  // 合法手の数。パスも1個。0なら末端ノード。
@@ -15,16 +26,48 @@ public:
     int value_n[MAX_LEGAL_MOVES];       // 子ノードの訪問回数
     float value_w[MAX_LEGAL_MOVES];     // 子ノードからバックアップされたスコア合計
     float value_p[MAX_LEGAL_MOVES];     // 指し手の事前確率
+    int8_t proven;                      // このノードの証明済みの勝敗(ProvenResult)
+    int8_t edge_proven[MAX_LEGAL_MOVES]; // 指し手を選んだ場合の証明済みの勝敗(ProvenResult)。このノードの手番側から見た結果。
+    int8_t pending;                     // 評価を要求中で、まだ結果が割り当てられていない(複数の評価を同時に要求する場合に用いる)
+    int value_n_sum;                    // value_nの合計。子ノード選択のたびに合計しなくて済むよう保持する。
 
     void clear()
     {
         memset(this, 0, sizeof(*this));
     }
 
+    // 指し手を訪問したことを記録する
+    void visit(int edge)
+    {
+        value_n[edge]++;
+        value_n_sum++;
+    }
+
     bool terminal() const
     {
         return n_legal_moves == 0;
     }
+
+    // 勝敗が証明されており、これ以上探索する必要がない
+    bool solved() const
+    {
+        return proven != PROVEN_NONE;
+    }
+
+    // バックアップに用いるスコア。証明済みなら確定値。
+    float backup_score() const
+    {
+        switch (proven)
+        {
+        case PROVEN_WIN:
+            return 1.0F;
+        case PROVEN_LOSS:
+            return -1.0F;
+        case PROVEN_DRAW:
+            return 0.0F;
+        }
+        return score;
+    }
 };
 
 // 置換表
@@ -51,6 +94,17 @@ public:
         next_idx = 1;
     }
 
+    // 確保済みの要素数
+    size_t used() const
+    {
+        return next_idx - 1;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
     // 新しい要素を確保する。内容は初期化されないため、必要に応じてTreeNode.clear()を用いる。
     TreeNode *alloc()
     {
@@ -108,11 +162,14 @@ namespace MCTSBase
 
         if (!terminal)
         {
-            vector<Move> legal_moves;
+            // 自己対局では展開のたびに呼ばれるので、合法手はビットボードから直接move_listに書き込み、vectorを確保しない
+            BoardPlane bb;
+            bool mate = false;
             if (mate_search)
             {
-                mate_found = b.legal_moves_with_mate_1ply(legal_moves, true, mate_move);
-                if (mate_found)
+                mate = b.legal_moves_bb_with_mate_1ply(bb, mate_move);
+                mate_found = mate;
+                if (mate)
                 {
                     // 勝ちなのでscoreを設定
                     // n_legal_moves==0となるので、terminalとして扱われる
@@ -121,14 +178,21 @@ namespace MCTSBase
             }
             else
             {
-                b.legal_moves(legal_moves, true);
+                b.legal_moves_bb(bb);
             }
-            
-            // mate_found == trueの場合はlegal_moves.size()==0
-            tn->n_legal_moves = legal_moves.size();
-            for (int i = 0; i < legal_moves.size(); i++)
+
+            // mate_found == trueの場合はn_legal_moves==0
+            tn->n_legal_moves = 0;
+            if (!mate)
             {
-                tn->move_list[i] = static_cast<uint8_t>(legal_moves[i]);
+                for (; bb; bb &= bb - 1)
+                {
+                    tn->move_list[tn->n_legal_moves++] = static_cast<uint8_t>(__builtin_ctzll(bb));
+                }
+                if (tn->n_legal_moves == 0)
+                {
+                    tn->move_list[tn->n_legal_moves++] = static_cast<uint8_t>(MOVE_PASS);
+                }
             }
             // tn->childrenは0初期化されているので、子ノードが存在していない状態を表す。エッジの情報(value_n)なども0になる。
         }
@@ -137,21 +201,32 @@ namespace MCTSBase
             tn->n_legal_moves = 0;
         }
         tn->score = score;
+        if (tn->terminal())
+        {
+            // ゲーム終了または詰みの場合は勝敗が確定している
+            tn->proven = score > 0.0F ? PROVEN_WIN : (score < 0.0F ? PROVEN_LOSS : PROVEN_DRAW);
+        }
         return tn;
     }
 
-    int select_edge(const TreeNode *node, float c_puct)
+    // 子ノードの訪問回数の合計
+    int visit_sum(const TreeNode *node)
     {
-        int n_sum = 0;
-        for (int i = 0; i < node->n_legal_moves; i++)
-        {
-            n_sum += node->value_n[i];
-        }
-        float n_sum_sqrt = sqrt(static_cast<float>(n_sum)) + 0.001;
+        return node->value_n_sum;
+    }
+
+    int select_edge_scalar(const TreeNode *node, float c_puct)
+    {
+        float n_sum_sqrt = sqrt(static_cast<float>(node->value_n_sum)) + 0.001;
         float best_score = -1000.0F;
         int best_edge = 0;
         for (int i = 0; i < node->n_legal_moves; i++)
         {
+            if (node->edge_proven[i] == PROVEN_LOSS)
+            {
+                // 負けが証明された指し手は探索しない
+                continue;
+            }
             float u = node->value_p[i] / static_cast<float>(node->value_n[i] + 1) * n_sum_sqrt * c_puct;
             // 未訪問ノードのスコアは現局面と同じと仮定
             float q = node->value_n[i] == 0 ? node->score : (node->value_w[i] / static_cast<float>(node->value_n[i]));
@@ -165,5 +240,288 @@ namespace MCTSBase
 
         return best_edge;
     }
+
+#ifdef SIMD_X86
+    // select_edge_scalarと同じ計算を、全エッジ(MAX_LEGAL_MOVES=32)について8要素ずつ行う
+    TARGET_AVX2 int select_edge_avx2(const TreeNode *node, float c_puct)
+    {
+        static_assert(MAX_LEGAL_MOVES == 32, "select_edge_avx2 assumes 32 edges");
+        const __m256 coef = _mm256_set1_ps((sqrt(static_cast<float>(node->value_n_sum)) + 0.001F) * c_puct);
+        const __m256 node_score = _mm256_set1_ps(node->score);
+        const __m256 excluded_score = _mm256_set1_ps(-INFINITY);
+        const __m256i n_legal_moves = _mm256_set1_epi32(node->n_legal_moves);
+        const __m256i proven_loss = _mm256_set1_epi32(PROVEN_LOSS);
+        const __m256i one = _mm256_set1_epi32(1);
+        __m256 s[4];
+        for (int b = 0; b < 4; b++)
+        {
+            __m256i n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&node->value_n[b * 8]));
+            __m256 w = _mm256_loadu_ps(&node->value_w[b * 8]);
+            __m256 p = _mm256_loadu_ps(&node->value_p[b * 8]);
+            __m256i proven = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&node->edge_proven[b * 8])));
+            __m256 u = _mm256_div_ps(_mm256_mul_ps(p, coef), _mm256_cvtepi32_ps(_mm256_add_epi32(n, one)));
+            // 未訪問ノードのスコアは現局面と同じと仮定
+            __m256 q = _mm256_div_ps(w, _mm256_cvtepi32_ps(_mm256_max_epi32(n, one)));
+            q = _mm256_blendv_ps(q, node_score, _mm256_castsi256_ps(_mm256_cmpeq_epi32(n, _mm256_setzero_si256())));
+            __m256 sb = _mm256_add_ps(u, q);
+            // 合法手の範囲外と、負けが証明された指し手は選ばない
+            __m256i lane = _mm256_add_epi32(_mm256_set1_epi32(b * 8), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            __m256i excluded = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(lane, one), n_legal_moves), _mm256_cmpeq_epi32(proven, proven_loss));
+            s[b] = _mm256_blendv_ps(sb, excluded_score, _mm256_castsi256_ps(excluded));
+        }
+        __m256 best = hmax256_ps(_mm256_max_ps(_mm256_max_ps(s[0], s[1]), _mm256_max_ps(s[2], s[3])));
+        // 最大値をとる最初のエッジ
+        uint32_t mask = 0;
+        for (int b = 3; b >= 0; b--)
+        {
+            mask = (mask << 8) | static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(s[b], best, _CMP_EQ_OQ)));
+        }
+        return mask ? __builtin_ctz(mask) : 0;
+    }
+#endif
+
+    int select_edge(const TreeNode *node, float c_puct)
+    {
+#ifdef SIMD_X86
+        if (cpu_has_avx2())
+        {
+            return select_edge_avx2(node, c_puct);
+        }
+#endif
+        return select_edge_scalar(node, c_puct);
+    }
+
+    void assign_eval_result_scalar(TreeNode *leaf, const float *policy_logits, float value_logit)
+    {
+        leaf->score = tanh(value_logit);
+        // 合法手のみでsoftmaxを計算
+        float max_logit = -1000.0F;
+        for (int i = 0; i < leaf->n_legal_moves; i++)
+        {
+            Move m = leaf->move_list[i];
+            float logit = policy_logits[m];
+            if (max_logit < logit)
+            {
+                max_logit = logit;
+            }
+        }
+        float expsum = 0.0F;
+        for (int i = 0; i < leaf->n_legal_moves; i++)
+        {
+            Move m = leaf->move_list[i];
+            float logit = policy_logits[m];
+            float explogit = exp(logit - max_logit);
+            expsum += explogit;
+            leaf->value_p[i] = explogit;
+        }
+        for (int i = 0; i < leaf->n_legal_moves; i++)
+        {
+            leaf->value_p[i] /= expsum;
+        }
+    }
+
+#ifdef SIMD_X86
+    // assign_eval_result_scalarと同じ計算を、近似expを用いて8要素ずつ行う
+    TARGET_AVX2 void assign_eval_result_avx2(TreeNode *leaf, const float *policy_logits, float value_logit)
+    {
+        // tanh(x) = 1 - 2 / (exp(2x) + 1)
+        float e2x = _mm256_cvtss_f32(exp256_ps(_mm256_set1_ps(2.0F * value_logit)));
+        leaf->score = 1.0F - 2.0F / (e2x + 1.0F);
+
+        const int n_blocks = (leaf->n_legal_moves + 7) / 8;
+        const __m256i n_legal_moves = _mm256_set1_epi32(leaf->n_legal_moves);
+        __m256 logits[4];
+        __m256i valid[4];
+        __m256 max_logit = _mm256_set1_ps(-INFINITY);
+        for (int b = 0; b < n_blocks; b++)
+        {
+            __m256i lane = _mm256_add_epi32(_mm256_set1_epi32(b * 8), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            valid[b] = _mm256_cmpgt_epi32(n_legal_moves, lane);
+            __m256i moves = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&leaf->move_list[b * 8])));
+            logits[b] = _mm256_mask_i32gather_ps(_mm256_set1_ps(-INFINITY), policy_logits, moves, _mm256_castsi256_ps(valid[b]), 4);
+            max_logit = _mm256_max_ps(max_logit, logits[b]);
+        }
+        max_logit = hmax256_ps(max_logit);
+        __m256 expsum = _mm256_setzero_ps();
+        for (int b = 0; b < n_blocks; b++)
+        {
+            logits[b] = _mm256_and_ps(exp256_ps(_mm256_sub_ps(logits[b], max_logit)), _mm256_castsi256_ps(valid[b]));
+            expsum = _mm256_add_ps(expsum, logits[b]);
+        }
+        __m256 inv_expsum = _mm256_div_ps(_mm256_set1_ps(1.0F), hsum256_ps(expsum));
+        for (int b = 0; b < n_blocks; b++)
+        {
+            _mm256_storeu_ps(&leaf->value_p[b * 8], _mm256_mul_ps(logits[b], inv_expsum));
+        }
+    }
+#endif
+
+    // DNNの評価結果を末端ノードに設定する。scoreはvalueのtanh、value_pは合法手に限定したpolicyのsoftmax。
+    void assign_eval_result(TreeNode *leaf, const float *policy_logits, float value_logit)
+    {
+        assert(leaf->n_legal_moves);
+        if (leaf->n_legal_moves == 1)
+        {
+            // パスを含め、指し手が1つなら確率1(パスのlogitは存在しない)
+            leaf->score = tanh(value_logit);
+            leaf->value_p[0] = 1.0F;
+            return;
+        }
+#ifdef SIMD_X86
+        if (cpu_has_avx2())
+        {
+            assign_eval_result_avx2(leaf, policy_logits, value_logit);
+            return;
+        }
+#endif
+        assign_eval_result_scalar(leaf, policy_logits, value_logit);
+    }
+
+    // 子ノードの証明済みの勝敗から、ノードの勝敗をミニマックスで求める
+    int8_t update_proven(TreeNode *node)
+    {
+        bool all_proven = true, has_draw = false;
+        for (int i = 0; i < node->n_legal_moves; i++)
+        {
+            switch (node->edge_proven[i])
+            {
+            case PROVEN_WIN:
+                node->proven = PROVEN_WIN;
+                return node->proven;
+            case PROVEN_DRAW:
+                has_draw = true;
+                break;
+            case PROVEN_NONE:
+                all_proven = false;
+                break;
+            }
+        }
+        if (all_proven)
+        {
+            node->proven = has_draw ? PROVEN_DRAW : PROVEN_LOSS;
+        }
+        return node->proven;
+    }
+
+    // leafのスコアをpathに沿ってバックアップする。leafの勝敗が証明済みなら、それも親ノードへ伝播する。
+    void backup_path(const vector<pair<TreeNode *, int>> &path, const TreeNode *leaf)
+    {
+        float score = leaf->backup_score();
+        int8_t proven = leaf->proven;
+        for (int i = int(path.size()) - 1; i >= 0; i--)
+        {
+            TreeNode *node = path[i].first;
+            int edge = path[i].second;
+            score = -score;
+            node->value_w[edge] += score;
+            if (proven != PROVEN_NONE)
+            {
+                // 子ノードの勝ちは親ノードの負け
+                node->edge_proven[edge] = proven == PROVEN_WIN ? PROVEN_LOSS : (proven == PROVEN_LOSS ? PROVEN_WIN : PROVEN_DRAW);
+                proven = update_proven(node);
+            }
+        }
+    }
+
+    // 評価待ちの経路に仮想損失を加える(sign=1)、または取り除く(sign=-1)。
+    // 同じゲームで複数の末端局面の評価を同時に要求する際、同じ経路ばかりが選ばれるのを防ぐ。
+    void apply_virtual_loss(const vector<pair<TreeNode *, int>> &path, float virtual_loss, float sign)
+    {
+        for (auto &node_edge : path)
+        {
+            // 指し手を選んだ側から見て負けとみなす
+            node_edge.first->value_w[node_edge.second] -= virtual_loss * sign;
+        }
+    }
+
+    // 経路上の訪問を取り消す。評価待ちのノードに到達し、プレイアウトを中止する場合に用いる。
+    void revert_visits(const vector<pair<TreeNode *, int>> &path)
+    {
+        for (auto &node_edge : path)
+        {
+            node_edge.first->value_n[node_edge.second]--;
+            node_edge.first->value_n_sum--;
+        }
+    }
+
+    TreeNode *find_existing_root_recursive(const TreeTable *tree_table, TreeNode *node, Board &b, const Board &query, int depth)
+    {
+        if (b == query)
+        {
+            return node;
+        }
+        if (depth == 0)
+        {
+            return nullptr;
+        }
+        if (node->terminal())
+        {
+            return nullptr;
+        }
+
+        for (int edge = 0; edge < node->n_legal_moves; edge++)
+        {
+            int child_node_idx = node->children[edge];
+            if (child_node_idx)
+            {
+                UndoInfo undo_info;
+                b.do_move(node->move_list[edge], undo_info);
+                TreeNode *found = find_existing_root_recursive(tree_table, tree_table->at(child_node_idx), b, query, depth - 1);
+                b.undo_move(undo_info);
+                if (found)
+                {
+                    return found;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    // 探索開始局面が既存の木に存在すれば、それを返す
+    TreeNode *find_existing_root(const TreeTable *tree_table, TreeNode *last_root_node, const Board &last_root_board, const Board &query)
+    {
+        if (last_root_node == nullptr)
+        {
+            return nullptr;
+        }
+        Board b(last_root_board);
+        return find_existing_root_recursive(tree_table, last_root_node, b, query, 4); // パスや、合法手が1つしかなかった場合、2手では足りない可能性がある
+    }
+
+    // nodeを根とする部分木をdstにコピーし、コピー先の根を返す。未評価の子ノードは持たないこと(pending==0)。
+    // 置換表は解放できないため、再利用する部分木だけを別のテーブルに詰めてコピーすることで、使用量を1手分に保つ。
+    TreeNode *copy_subtree(const TreeTable *src, const TreeNode *node, TreeTable *dst)
+    {
+        TreeNode *copied = dst->alloc();
+        *copied = *node;
+        for (int edge = 0; edge < node->n_legal_moves; edge++)
+        {
+            int child_node_idx = node->children[edge];
+            if (child_node_idx)
+            {
+                copied->children[edge] = dst->get_index(copy_subtree(src, src->at(child_node_idx), dst));
+            }
+        }
+        return copied;
+    }
+
+    // 勝ちまたは引き分けが証明された指し手を返す。なければ-1。
+    int proven_best_edge(const TreeNode *node)
+    {
+        int draw_edge = -1;
+        for (int i = 0; i < node->n_legal_moves; i++)
+        {
+            if (node->edge_proven[i] == PROVEN_WIN)
+            {
+                return i;
+            }
+            if (node->edge_proven[i] == PROVEN_DRAW)
+            {
+                draw_edge = i;
+            }
+        }
+        return node->proven == PROVEN_DRAW ? draw_edge : -1;
+    }
 }
 #endif
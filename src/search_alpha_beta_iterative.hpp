@@ -1,6 +1,7 @@
 #ifndef _SEARCH_ALPHA_BETA_ITERATIVE_
 #define _SEARCH_ALPHA_BETA_ITERATIVE_
 #include "search_base.hpp"
+#include "time_manager.hpp"
 
 // 反復深化探索でアルファベータ法で探索するAI
 class SearchAlphaBetaIterative : public SearchBase
@@ -9,14 +10,32 @@ class SearchAlphaBetaIterative : public SearchBase
     mt19937 engine;
     normal_distribution<float> dist;
     const int score_scale = 256;
-    int node_count;    // 評価関数を呼び出した回数
-    int time_limit_ms; // 探索時間の制限[ms]。これを超えたことを検知したら探索を終了する。ルール上の制限時間より短く設定する必要がある。
-    bool stop;         // 探索の内部で、時間切れなどで中断すべき場合にtrueにセットする。
+    int node_count; // 評価関数を呼び出した回数
+    bool stop;      // 探索の内部で、時間切れなどで中断すべき場合にtrueにセットする。
     int check_time_skip;
-    chrono::system_clock::time_point time_to_stop_search; // 探索を終了すべき時刻
+    TimeManager time_manager;
+
+    // 毎手time_limit_msまで探索する設定
+    static TimeManager::TimeManagerConfig fixed_time_config(int time_limit_ms)
+    {
+        TimeManager::TimeManagerConfig time_config;
+        time_config.turn_limit_ms = time_limit_ms;
+        time_config.first_turn_limit_ms = time_limit_ms;
+        time_config.margin_ms = 0;
+        time_config.game_limit_ms = 0;
+        time_config.soft_ratio = 1.0F;
+        time_config.max_extension = 1.0F;
+        time_config.time_bank = false;
+        return time_config;
+    }
 
 public:
-    SearchAlphaBetaIterative(int time_limit_ms = 1000, float noise_scale = 0.1) : seed_gen(), engine(seed_gen()), dist(0.0, noise_scale * score_scale), time_limit_ms(time_limit_ms), check_time_skip(0)
+    // time_limit_ms: 探索時間の制限[ms]。これを超えたことを検知したら探索を終了する。ルール上の制限時間より短く設定する必要がある。
+    SearchAlphaBetaIterative(int time_limit_ms = 1000, float noise_scale = 0.1) : SearchAlphaBetaIterative(fixed_time_config(time_limit_ms), noise_scale)
+    {
+    }
+
+    SearchAlphaBetaIterative(const TimeManager::TimeManagerConfig &time_config, float noise_scale) : seed_gen(), engine(seed_gen()), dist(0.0, noise_scale * score_scale), check_time_skip(0), time_manager(time_config)
     {
     }
 
@@ -25,22 +44,27 @@ public:
         return "AlphaBetaIterative";
     }
 
+    void newgame()
+    {
+        time_manager.newgame();
+    }
+
     Move search(string &msg)
     {
         node_count = 0;
         stop = false;
+        time_manager.start_turn(BOARD_AREA - board.piece_sum());
         vector<Move> move_list;
         board.legal_moves(move_list);
         if (move_list.empty())
         {
+            time_manager.end_turn(false);
             return MOVE_PASS;
         }
         else
         {
-            auto search_start_time = chrono::system_clock::now();
-            time_to_stop_search = search_start_time + chrono::milliseconds(time_limit_ms);
             Move bestmove = 0;
-            int score = 0, valid_depth = 0;
+            int score = 0, valid_depth = 0, stable_depths = 0;
             for (int depth = 1; depth < 20; depth++)
             {
                 Move cur_bestmove;
@@ -50,15 +74,20 @@ public:
                     // stopで終了した探索は途中で打ち切られているので使用しない
                     break;
                 }
+                // 最善手が連続して同じ深さの数
+                stable_depths = (valid_depth > 0 && cur_bestmove == bestmove) ? stable_depths + 1 : 0;
                 valid_depth = depth;
                 bestmove = cur_bestmove;
-                score = score;
+                score = cur_score;
+                if (time_manager.should_stop(stable_depths >= 2))
+                {
+                    break;
+                }
             }
-            auto search_end_time = chrono::system_clock::now();
-            auto search_duration = search_end_time - search_start_time;
             stringstream ss;
-            ss << "score " << score << " time " << chrono::duration_cast<chrono::milliseconds>(search_duration).count() << " nodes " << node_count << " depth " << valid_depth;
+            ss << "score " << score << " time " << static_cast<int>(time_manager.elapsed_ms()) << " nodes " << node_count << " depth " << valid_depth;
             msg = ss.str();
+            time_manager.end_turn();
 
             return bestmove;
         }
@@ -75,7 +104,7 @@ private:
         // システムコール回数を減らす。数msに1回の呼び出しになる。
         if (check_time_skip == 0)
         {
-            if (chrono::system_clock::now() > time_to_stop_search)
+            if (time_manager.hard_timeout())
             {
                 stop = true;
                 return true;
@@ -13,5 +13,9 @@ public:
     virtual string name() = 0;
     // 新しいゲームが開始する際に呼ぶ。内部データのクリアを行う。
     virtual void newgame() {}
+    // searchが返した指し手を指した後、相手番の間に呼ぶ。バックグラウンドで思考する。次のsearchで停止する。
+    virtual void start_ponder() {}
+    // バックグラウンドの思考を停止する
+    virtual void stop_ponder() {}
 };
 #endif
@@ -2,8 +2,13 @@
 #define _SEARCH_MCTS_
 #include <memory>
 #include <cassert>
+#include <thread>
+#include <atomic>
 #include "dnn_evaluator.hpp"
 #include "mcts_base.hpp"
+#include "endgame_solver.hpp"
+#include "search_profiler.hpp"
+#include "time_manager.hpp"
 
 // MCTS
 class SearchMCTS : public SearchBase
@@ -21,11 +26,26 @@ class SearchMCTS : public SearchBase
     TreeNode *root_node;
     Board root_board;
     shared_ptr<DNNEvaluator> dnn_evaluator;
-    chrono::system_clock::time_point time_to_stop_search; // 探索を終了すべき時刻
+    EndgameSolver endgame_solver;
+    TimeManager time_manager;
+    int best_edge_last;           // 直前のプレイアウト後の最善手(訪問回数最大)
+    int best_edge_changed_at;     // 最善手が最後に変化したときのプレイアウト数
+    int playout_count_at_start;   // 探索開始時のプレイアウト数(ルート再利用時は既存の訪問回数)
+    static const int futile_check_min_playouts = 8;
 
     random_device seed_gen;
     default_random_engine random_engine;
 
+    // 相手番の間の思考(ponder)
+    Board last_search_board; // 直前にsearchした局面
+    Move last_move;          // 直前にsearchが返した指し手
+    thread ponder_thread;
+    atomic_bool ponder_stop_flag;
+    int ponder_playout_count;
+
+    SearchProfiler profiler; // -DMCTS_PROFILE でビルドした場合のみ計測する
+    string last_profile_json;
+
 public:
     class SearchMCTSConfig
     {
@@ -33,10 +53,17 @@ public:
         int playout_limit;
         size_t table_size;
         float c_puct;
-        int time_limit_ms; // 探索時間の制限[ms]。これを超えたことを検知したら探索を終了する。ルール上の制限時間より短く設定する必要がある。
-        bool mate_1ply;    // 一手詰め探索を用いるか
+        TimeManager::TimeManagerConfig time_config; // 持ち時間の設定
+        bool mate_1ply;                             // 一手詰め探索を用いるか
         // 盤上の石の数がこの値以下の時、ノードの訪問回数に比例した確率で指し手を選択する
         int select_move_proportional_until_move;
+        // 空きマスがこの数以下の末端ノードは、DNNで評価する代わりに完全読みで勝敗を確定させる(0なら使用しない)
+        int endgame_solve_empties;
+        // 完全読み1回の探索ノード数の上限(0なら無制限)。超えた場合は打ち切り、DNNで評価する。
+        long long endgame_solve_max_nodes;
+        // 相手番の間にバックグラウンドで探索木を成長させるか。1回のponderでのプレイアウト数はplayout_limitまで。
+        // codingameでは相手番の間の計算速度が非常に低いため無効にする(feature_check/ponder_check.cpp)。
+        bool ponder;
     };
 
 private:
@@ -48,8 +75,17 @@ public:
           config(config),
           tree_table(new TreeTable(config.table_size)),
           root_node(nullptr),
-          random_engine(seed_gen())
+          time_manager(config.time_config),
+          random_engine(seed_gen()),
+          last_move(-1),
+          ponder_stop_flag(false),
+          ponder_playout_count(0)
+    {
+    }
+
+    ~SearchMCTS()
     {
+        stop_ponder();
     }
 
     string name()
@@ -59,15 +95,95 @@ public:
 
     void newgame()
     {
+        stop_ponder();
         tree_table->clear();
         root_node = nullptr;
+        last_move = -1;
+        ponder_playout_count = 0;
+        time_manager.newgame();
     }
 
     // 対局用
     Move search(string &msg)
     {
-        auto search_start_time = chrono::system_clock::now();
-        time_to_stop_search = search_start_time + chrono::milliseconds(config.time_limit_ms);
+        stop_ponder();
+        PROFILE_EXEC(profiler.reset());
+        time_manager.start_turn(BOARD_AREA - board.piece_sum());
+        bool searched = false;
+        Move move = search_move(msg, searched);
+        time_manager.end_turn(searched);
+        last_search_board = board;
+        last_move = move;
+        PROFILE_EXEC(last_profile_json = profiler.to_json(board.piece_sum(), tree_table->used(), tree_table->size()));
+        PROFILE_EXEC(cerr << last_profile_json << endl);
+        return move;
+    }
+
+    // 直前のsearchの計測結果(JSON)。-DMCTS_PROFILE でビルドしていなければ空。
+    string profile_json() const
+    {
+        return last_profile_json;
+    }
+
+    // searchが返した指し手を指した局面から、相手番の間に探索を進める。次のsearchで自動的に停止する。
+    void start_ponder()
+    {
+        stop_ponder();
+        ponder_playout_count = 0;
+        if (!config.ponder || last_move < 0)
+        {
+            return;
+        }
+        Board b(last_search_board);
+        UndoInfo undo_info;
+        b.do_move(last_move, undo_info);
+        if (b.is_gameover())
+        {
+            return;
+        }
+        TreeNode *existing_root = MCTSBase::find_existing_root(tree_table.get(), root_node, root_board, b);
+        if (existing_root && existing_root->terminal())
+        {
+            // 相手の詰みが見つかっている
+            return;
+        }
+        if (reusable_root(existing_root))
+        {
+            root_node = existing_root;
+        }
+        else
+        {
+            make_root(b);
+        }
+        root_board = b;
+        ponder_stop_flag = false;
+        ponder_thread = thread(&SearchMCTS::ponder_loop, this, b);
+    }
+
+    void stop_ponder()
+    {
+        if (ponder_thread.joinable())
+        {
+            ponder_stop_flag = true;
+            ponder_thread.join();
+        }
+    }
+
+private:
+    void ponder_loop(Board b)
+    {
+        // 置換表はゲーム終了まで解放しないので、1回のponderで確保するノード数をplayout_limitまでに制限する
+        while (!ponder_stop_flag && ponder_playout_count < config.playout_limit && !root_node->solved())
+        {
+            vector<pair<TreeNode *, int>> path;
+            search_recursive(b, root_node, path);
+            ponder_playout_count++;
+        }
+    }
+
+    // searched: 探索を行った場合にtrueにする(詰みや合法手が1つの場合は探索せずに返す)
+    Move search_move(string &msg, bool &searched)
+    {
         vector<Move> move_list;
         if (config.mate_1ply)
         {
@@ -93,27 +209,53 @@ public:
         }
         else
         {
+            searched = true;
             start_search();
 
+            bool decided = false;
             while (true)
             {
-                if (playout_count >= config.playout_limit || chrono::system_clock::now() > time_to_stop_search)
+                if (playout_count >= config.playout_limit || time_manager.should_stop(root_stable()))
                 {
                     // playoutは終わり。指し手を決定する。
                     break;
                 }
+                if (root_node->solved())
+                {
+                    // 勝敗が証明されたので、これ以上探索しても指し手は変わらない
+                    break;
+                }
+                if (best_move_decided())
+                {
+                    // 余った時間は以降の手で使う
+                    decided = true;
+                    break;
+                }
 
                 search_tree();
             }
 
             auto choose_move_result = choose_move();
             stringstream ss;
-            ss << "value score " << choose_move_result.score << " playouts " << playout_count;
+            ss << "value score " << choose_move_result.score << " playouts " << playout_count << " time " << static_cast<int>(time_manager.elapsed_ms());
+            if (ponder_playout_count)
+            {
+                ss << " ponder " << ponder_playout_count;
+            }
+            if (root_node->solved())
+            {
+                ss << " proven";
+            }
+            if (decided)
+            {
+                ss << " decided";
+            }
             msg = ss.str();
             return choose_move_result.move;
         }
     }
 
+public:
     string print_tree() const
     {
         /*
@@ -133,120 +275,127 @@ public:
 private:
     void start_search()
     {
-        TreeNode *existing_root = find_existing_root(root_node, root_board, board);
+        TreeNode *existing_root = MCTSBase::find_existing_root(tree_table.get(), root_node, root_board, board);
         playout_count = 0; // root再利用の場合、すでに子ノードを訪問した回数だけ減らす
         root_board = board;
         // existing_root->terminal()となるのは詰み探索で詰みと判定された場合に起こりうる。ただしsearch()内で同様の詰み判定をしている限りはstart_search()は実行されない。詰み判定基準が異なる場合にはこの条件判断が起こりうる。
-        if (existing_root && !existing_root->terminal())
+        PROFILE_EXEC(profiler.add_root_query(reusable_root(existing_root)));
+        if (reusable_root(existing_root))
         {
             // 探索木中にルート局面があった
-            for (int edge = 0; edge < existing_root->n_legal_moves; edge++)
-            {
-                playout_count += existing_root->value_n[edge];
-            }
+            playout_count += MCTSBase::visit_sum(existing_root);
             root_node = existing_root;
         }
         else
         {
             make_root(board);
         }
+        best_edge_last = -1;
+        best_edge_changed_at = playout_count;
+        playout_count_at_start = playout_count;
     }
 
-    void make_root(const Board &b)
+    // ルートの、訪問回数最大の手(負けが証明された手を除く)と、その訪問回数、次善手の訪問回数を求める
+    void root_best_two(int &best_edge, int &best_n, int &second_n) const
     {
-        bool mate_found;
-        Move mate_move;
-        // 詰み探索は、searchの合法手列挙のタイミングで実施済み
-        root_node = MCTSBase::make_node(b, tree_table.get(), false, mate_found, mate_move);
-        if (!root_node->terminal())
-        {
-            // 評価が必要
-            auto eval_result = dnn_evaluator->evaluate(b);
-            assign_eval_result_to_leaf(root_node, &eval_result);
-        }
-        else
+        best_edge = -1;
+        best_n = -1;
+        second_n = 0;
+        for (int i = 0; i < root_node->n_legal_moves; i++)
         {
-            // ゲーム終了しているときに呼ばれるのは異常
-            cerr << "make_root called on terminal" << endl;
-            exit(1);
+            if (root_node->edge_proven[i] == PROVEN_LOSS && root_node->proven != PROVEN_LOSS)
+            {
+                continue;
+            }
+            int value_n = root_node->value_n[i];
+            if (value_n > best_n)
+            {
+                second_n = max(best_n, 0);
+                best_n = value_n;
+                best_edge = i;
+            }
+            else if (value_n > second_n)
+            {
+                second_n = value_n;
+            }
         }
     }
 
-    TreeNode *find_existing_root(TreeNode *last_root_node, const Board &last_root_board, const Board &query)
+    // 探索が安定しているか。最善手(訪問回数最大)が直近のプレイアウトの間変化しておらず、次善手との訪問回数の差が十分大きければ安定とみなす。
+    bool root_stable()
     {
-        // 探索開始局面が既存の木に存在すれば、それを返す
-        if (last_root_node == nullptr)
+        int best_edge, best_n, second_n;
+        root_best_two(best_edge, best_n, second_n);
+        if (best_edge != best_edge_last)
         {
-            return nullptr;
+            best_edge_last = best_edge;
+            best_edge_changed_at = playout_count;
         }
-        Board b(last_root_board);
-        return find_existing_root_recursive(last_root_node, b, query, 4); // パスや、合法手が1つしかなかった場合、2手では足りない可能性がある
+        int v_sum = MCTSBase::visit_sum(root_node);
+        // 直近1/4のプレイアウトで最善手が変わらず、次善手と訪問回数の1割以上の差がある
+        return (playout_count - best_edge_changed_at) * 4 >= playout_count && (best_n - second_n) * 10 >= v_sum;
     }
 
-    TreeNode *find_existing_root_recursive(TreeNode *node, Board &b, const Board &query, int depth)
+    // 残りのプレイアウトをすべて次善手に費やしても訪問回数最大の手が変わらないなら、探索を続けても無駄である。
+    // 残りのプレイアウト数は、playout_limitと、この手番のプレイアウト速度で残り時間内にできる数の小さいほう。
+    bool best_move_decided() const
     {
-        if (b == query)
-        {
-            return node;
-        }
-        if (depth == 0)
+        if (board.piece_sum() <= config.select_move_proportional_until_move)
         {
-            return nullptr;
+            // 訪問回数に比例して指し手を選ぶため、訪問回数の分布そのものに意味がある
+            return false;
         }
-        if (node->terminal())
+        int searched = playout_count - playout_count_at_start;
+        if (searched < futile_check_min_playouts)
         {
-            return nullptr;
-        }
-
-        for (int edge = 0; edge < node->n_legal_moves; edge++)
-        {
-            int child_node_idx = node->children[edge];
-            if (child_node_idx)
-            {
-                UndoInfo undo_info;
-                b.do_move(node->move_list[edge], undo_info);
-                TreeNode *found = find_existing_root_recursive(tree_table->at(child_node_idx), b, query, depth - 1);
-                b.undo_move(undo_info);
-                if (found)
-                {
-                    return found;
-                }
-            }
+            // プレイアウト速度の推定が不正確
+            return false;
         }
+        int best_edge, best_n, second_n;
+        root_best_two(best_edge, best_n, second_n);
+        double playouts_per_ms = searched / max(time_manager.elapsed_ms(), 1e-3);
+        double remaining = min<double>(config.playout_limit - playout_count, playouts_per_ms * time_manager.max_remaining_ms());
+        return best_n - second_n > remaining;
+    }
 
-        return nullptr;
+    bool reusable_root(const TreeNode *existing_root) const
+    {
+        // 完全読みで勝敗だけ確定させたノードは子ノードの情報を持たない(訪問回数が0)ため、ルートとして再利用しない
+        return existing_root && !existing_root->terminal() && !(existing_root->solved() && MCTSBase::visit_sum(existing_root) == 0);
     }
 
-    float assign_eval_result_to_leaf(TreeNode *leaf, const DNNEvaluatorResult *eval_result)
+    void make_root(const Board &b)
     {
-        leaf->score = tanh(eval_result->value_logit);
-        assert(leaf->n_legal_moves);
-        // 合法手のみでsoftmaxを計算
-        float max_logit = -1000.0F;
-        for (int i = 0; i < leaf->n_legal_moves; i++)
+        bool mate_found;
+        Move mate_move;
+        // 詰み探索は、searchの合法手列挙のタイミングで実施済み
+        root_node = MCTSBase::make_node(b, tree_table.get(), false, mate_found, mate_move);
+        if (!root_node->terminal())
         {
-            Move m = leaf->move_list[i];
-            float logit = eval_result->policy_logits[m];
-            if (max_logit < logit)
-            {
-                max_logit = logit;
-            }
+            // 評価が必要
+            auto eval_result = dnn_evaluator->evaluate(b);
+            MCTSBase::assign_eval_result(root_node, eval_result.policy_logits, eval_result.value_logit);
         }
-        float expsum = 0.0F;
-        for (int i = 0; i < leaf->n_legal_moves; i++)
+        else
         {
-            Move m = leaf->move_list[i];
-            float logit = eval_result->policy_logits[m];
-            float explogit = exp(logit - max_logit);
-            expsum += explogit;
-            leaf->value_p[i] = explogit;
+            // ゲーム終了しているときに呼ばれるのは異常
+            cerr << "make_root called on terminal" << endl;
+            exit(1);
         }
-        for (int i = 0; i < leaf->n_legal_moves; i++)
+    }
+
+    // 勝敗を確定させる。子ノードは展開しないが、solved()となるため以降の探索で末端として扱われる。
+    // ノード数の上限までに読み切れなければfalseを返し、leafは変更しない。
+    bool solve_leaf(Board &b, TreeNode *leaf)
+    {
+        int result = endgame_solver.solve_wld(b, config.endgame_solve_max_nodes);
+        if (result == EndgameSolver::SOLVE_ABORTED)
         {
-            leaf->value_p[i] /= expsum;
+            return false;
         }
-
-        return leaf->score;
+        leaf->score = static_cast<float>(result);
+        leaf->proven = result > 0 ? PROVEN_WIN : (result < 0 ? PROVEN_LOSS : PROVEN_DRAW);
+        return true;
     }
 
     void search_tree()
@@ -263,18 +412,23 @@ private:
 
     void search_recursive(Board &b, TreeNode *node, vector<pair<TreeNode *, int>> &path)
     {
-        if (node->terminal())
+        if (node->terminal() || node->solved())
         {
-            backup_path(path, node->score);
+            PROFILE_EXEC(profiler.add_playout(int(path.size())));
+            PROFILE_BEGIN(backup_begin);
+            MCTSBase::backup_path(path, node);
+            PROFILE_END(profiler, PHASE_BACKUP, backup_begin);
             return;
         }
 
+        PROFILE_BEGIN(select_begin);
         int edge = MCTSBase::select_edge(node, config.c_puct);
+        PROFILE_END(profiler, PHASE_SELECT, select_begin);
         UndoInfo undo_info;
         b.do_move(static_cast<Move>(node->move_list[edge]), undo_info);
         path.push_back({node, edge});
         int child_node_idx = node->children[edge];
-        node->value_n[edge]++;
+        node->visit(edge);
         if (child_node_idx)
         {
             search_recursive(b, tree_table->at(child_node_idx), path);
@@ -284,31 +438,39 @@ private:
             // 子ノードがまだ生成されていない
             bool mate_found;
             Move mate_move;
+            PROFILE_BEGIN(expand_begin);
             TreeNode *child_node = MCTSBase::make_node(b, tree_table.get(), config.mate_1ply, mate_found, mate_move);
+            PROFILE_END(profiler, PHASE_EXPAND, expand_begin);
             node->children[edge] = tree_table->get_index(child_node);
             if (!child_node->terminal())
             {
-                // 評価が必要
-                auto eval_result = dnn_evaluator->evaluate(b);
-                assign_eval_result_to_leaf(child_node, &eval_result);
+                bool solved = false;
+                if (BOARD_AREA - b.piece_sum() <= config.endgame_solve_empties)
+                {
+                    // 完全読みは正確で、多くの局面ではDNN評価と同程度の時間で済む。手数のかかる局面は打ち切ってDNNで評価する。
+                    PROFILE_BEGIN(solve_begin);
+                    solved = solve_leaf(b, child_node);
+                    PROFILE_END(profiler, PHASE_SOLVE, solve_begin);
+                }
+                if (!solved)
+                {
+                    // 評価が必要
+                    PROFILE_BEGIN(evaluate_begin);
+                    auto eval_result = dnn_evaluator->evaluate(b);
+                    PROFILE_END(profiler, PHASE_EVALUATE, evaluate_begin);
+                    MCTSBase::assign_eval_result(child_node, eval_result.policy_logits, eval_result.value_logit);
+                }
             }
             // backup
-            backup_path(path, child_node->score);
+            PROFILE_EXEC(profiler.add_playout(int(path.size())));
+            PROFILE_BEGIN(backup_begin);
+            MCTSBase::backup_path(path, child_node);
+            PROFILE_END(profiler, PHASE_BACKUP, backup_begin);
         }
 
         b.undo_move(undo_info);
     }
 
-    void backup_path(const vector<pair<TreeNode *, int>> &path, float leaf_score)
-    {
-        float score = leaf_score;
-        for (int i = int(path.size()) - 1; i >= 0; i--)
-        {
-            score = -score;
-            path[i].first->value_w[path[i].second] += score;
-        }
-    }
-
     ChooseMoveResult choose_move()
     {
         Move move = MOVE_PASS;
@@ -316,21 +478,35 @@ private:
         if (!root_node->terminal()) // terminalの場合はそもそもsearchが呼ばれないはず
         {
             int best_idx = 0;
-            if (board.piece_sum() <= config.select_move_proportional_until_move)
+            int proven_edge = MCTSBase::proven_best_edge(root_node);
+            // 負けが証明された指し手は、すべての指し手が負けの場合を除き選ばない
+            auto excluded = [this](int i)
+            { return root_node->edge_proven[i] == PROVEN_LOSS && root_node->proven != PROVEN_LOSS; };
+            int v_sum = 0;
+            for (int i = 0; i < root_node->n_legal_moves; i++)
             {
-                // 訪問回数に比例
-                int v_sum = 0;
-                for (int i = 0; i < root_node->n_legal_moves; i++)
+                if (!excluded(i))
                 {
-                    int value_n = root_node->value_n[i];
-                    v_sum += value_n;
+                    v_sum += root_node->value_n[i];
                 }
-
+            }
+            if (proven_edge >= 0)
+            {
+                // 勝ち(または引き分け)が証明された指し手
+                best_idx = proven_edge;
+            }
+            else if (board.piece_sum() <= config.select_move_proportional_until_move && v_sum > 0)
+            {
+                // 訪問回数に比例
                 uniform_int_distribution<int> dist(0, v_sum - 1);
                 int ctr = dist(random_engine);
 
                 for (int i = 0; i < root_node->n_legal_moves; i++)
                 {
+                    if (excluded(i))
+                    {
+                        continue;
+                    }
                     int value_n = root_node->value_n[i];
                     if (ctr < value_n)
                     {
@@ -346,6 +522,10 @@ private:
                 float best_avg_w = -1000.0F;
                 for (int i = 0; i < root_node->n_legal_moves; i++)
                 {
+                    if (excluded(i))
+                    {
+                        continue;
+                    }
                     int value_n = root_node->value_n[i];
                     float avg_w = root_node->value_w[i] / static_cast<float>(value_n);
                     if (best_n < value_n)
@@ -367,7 +547,14 @@ private:
                 }
             }
             move = static_cast<Move>(root_node->move_list[best_idx]);
-            score = root_node->value_w[best_idx] / static_cast<float>(root_node->value_n[best_idx]);
+            if (root_node->edge_proven[best_idx] != PROVEN_NONE)
+            {
+                score = root_node->edge_proven[best_idx] == PROVEN_WIN ? 1.0F : (root_node->edge_proven[best_idx] == PROVEN_LOSS ? -1.0F : 0.0F);
+            }
+            else
+            {
+                score = root_node->value_w[best_idx] / static_cast<float>(root_node->value_n[best_idx]);
+            }
         }
 
         ChooseMoveResult res;
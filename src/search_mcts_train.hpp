@@ -14,6 +14,11 @@ public:
     public:
         // プレイアウト回数
         int playout_limit;
+        // playout cap randomization: 確率full_search_probで通常の探索(playout_limit回、ルートノイズあり)を行い、
+        // それ以外はfast_playout_limit回の軽い探索(ルートノイズなし)で指し手だけを決める。軽い探索の指し手は方策の教師に使わない。
+        // full_search_prob>=1なら常に通常の探索。
+        int fast_playout_limit;
+        float full_search_prob;
         // 置換表の要素数
         size_t table_size;
         // プレイアウト時の子ノード選択のパラメータ
@@ -26,27 +31,53 @@ public:
         int select_move_proportional_until_move;
         // 一手詰め探索を用いるか
         bool mate_1ply;
+        // 1回のsearch_partialで評価を要求する末端局面の最大数。2以上の場合、評価待ちの経路に仮想損失を加えて異なる経路を選ばせる。
+        int max_pending_requests;
+        // 評価待ちの経路に加える仮想損失(評価値の範囲は-1から1)
+        float virtual_loss;
+        // 前の手の探索木のうち、新しいルート以下の部分木を再利用するか。再利用した訪問回数はプレイアウト回数に含める。
+        // ルートの事前確率には、元の値から改めてディリクレノイズを加える。
+        bool reuse_tree;
     };
 
-        class SearchPartialResult
+    // search_partialの結果。ヒープ確保を避けるため、種類をタグで区別する値型とする。
+    class SearchPartialResult
     {
     public:
-        virtual ~SearchPartialResult() = default;
-    };
+        enum Type
+        {
+            NONE,         // 内部用。探索を続ける。
+            MOVE,         // 指し手が決定した
+            EVAL_REQUEST, // 局面の評価が必要。評価対象局面はrequest_board(i)で得る。
+        };
+        Type type;
+        Move move;      // MOVEの場合、決定した指し手
+        float score;    // MOVEの場合、指し手の評価値
+        int n_requests; // EVAL_REQUESTの場合、評価対象局面の数。次のsearch_partialには同じ順序で評価結果を渡す。
+
+        static SearchPartialResult none()
+        {
+            SearchPartialResult result;
+            result.type = NONE;
+            return result;
+        }
 
-    class SearchPartialResultMove : public SearchPartialResult
-    {
-    public:
-        Move move;
-        float score;
-    };
+        static SearchPartialResult make_move(Move move, float score)
+        {
+            SearchPartialResult result;
+            result.type = MOVE;
+            result.move = move;
+            result.score = score;
+            return result;
+        }
 
-    class SearchPartialResultEvalRequest : public SearchPartialResult
-    {
-    public:
-        Board board;                             // 評価対象局面
-        vector<pair<TreeNode *, int>> tree_path; // 探索木の経路。TreeNodeと、その中のエッジのインデックスのペア。leafがルートの場合は空。
-        TreeNode *leaf;                          // 末端ノードのTreeNode。
+        static SearchPartialResult eval_request(int n_requests)
+        {
+            SearchPartialResult result;
+            result.type = EVAL_REQUEST;
+            result.n_requests = n_requests;
+            return result;
+        }
     };
 
     class EvalResult
@@ -59,6 +90,7 @@ public:
 private:
     const SearchMCTSConfig config;
     shared_ptr<TreeTable> tree_table;
+    shared_ptr<TreeTable> spare_table; // 探索木を再利用する際、部分木のコピー先とする置換表
     enum NextTask
     {
         START_SEARCH,
@@ -69,24 +101,55 @@ private:
     };
     NextTask next_task;
     int playout_count;
+    bool full_search;         // 現在の手が通常の探索か(falseなら軽い探索)
+    int current_playout_limit; // 現在の手のプレイアウト回数
 
     TreeNode *root_node;
+    Board root_board;
+    float root_prior[MAX_LEGAL_MOVES]; // ルートのノイズを加える前の事前確率
 
     random_device seed_gen;
     default_random_engine random_engine;
     gamma_distribution<float> gamma_distribution_for_dirichret;
-    shared_ptr<SearchPartialResultEvalRequest> prev_request;
+    bernoulli_distribution full_search_distribution;
+    // 評価を要求した局面、末端ノード、ルートからの経路(TreeNodeと、その中のエッジのインデックスのペア。末端がルートの場合は空)。
+    // バッファは使いまわし、プレイアウトごとのヒープ確保を避ける。
+    int n_requests;
+    vector<Board> request_boards;
+    vector<TreeNode *> request_leaves;
+    vector<vector<pair<TreeNode *, int>>> request_paths;
+
+    enum PlayoutResult
+    {
+        PLAYOUT_DONE,      // 末端まで到達し、バックアップした
+        PLAYOUT_EVAL,      // 評価要求を追加した
+        PLAYOUT_COLLISION, // 評価待ちのノードに到達したため中止した
+    };
 
 public:
 
     SearchMCTSTrain(const SearchMCTSConfig &config)
         : config(config),
           tree_table(new TreeTable(config.table_size)),
+          spare_table(config.reuse_tree ? new TreeTable(config.table_size) : nullptr),
           next_task(START_SEARCH),
           root_node(nullptr),
           random_engine(seed_gen()),
-          gamma_distribution_for_dirichret(config.root_noise_dirichret_alpha, 1.0F)
+          gamma_distribution_for_dirichret(config.root_noise_dirichret_alpha, 1.0F),
+          full_search_distribution(min(max(config.full_search_prob, 0.0F), 1.0F)),
+          n_requests(0),
+          request_boards(config.max_pending_requests),
+          request_leaves(config.max_pending_requests),
+          request_paths(config.max_pending_requests)
     {
+        if (config.max_pending_requests < 1)
+        {
+            throw runtime_error("SearchMCTSTrain: max_pending_requests must be >= 1");
+        }
+        for (auto &path : request_paths)
+        {
+            path.reserve(BOARD_AREA * 2); // パスを含めても、ゲームの手数を超える深さにはならない
+        }
     }
 
     string name()
@@ -107,10 +170,11 @@ public:
         return MOVE_PASS;
     }
 
-    // 局面の評価が必要か、指し手が決定するまで探索する
-    shared_ptr<SearchPartialResult> search_partial(const EvalResult *eval_result)
+    // 局面の評価が必要か、指し手が決定するまで探索する。
+    // eval_resultには、直前に返したEVAL_REQUESTの各局面の評価結果を、request_board(i)の順に並べて渡す。
+    SearchPartialResult search_partial(const EvalResult *eval_result)
     {
-        shared_ptr<SearchPartialResult> result;
+        SearchPartialResult result;
         do
         {
             switch (next_task)
@@ -131,25 +195,51 @@ public:
                 result = choose_move();
                 break;
             }
-        } while (!result);
-
-        prev_request = dynamic_pointer_cast<SearchPartialResultEvalRequest>(result);
+        } while (result.type == SearchPartialResult::NONE);
 
         return result;
     }
 
+    // 直前に決定した(または探索中の)指し手が、通常の探索によるものか
+    bool is_full_search() const
+    {
+        return full_search;
+    }
+
+    // 直前のsearch_partialが評価を要求したi番目の局面
+    const Board &request_board(int i) const
+    {
+        return request_boards[i];
+    }
+
 private:
-    shared_ptr<SearchPartialResult> start_search()
+    SearchPartialResult start_search()
     {
-        // 探索木の再利用をしないので、テーブルを初期化する。これによりテーブルのサイズは1手当たりのプレイアウト数+αだけで済む。
-        tree_table->clear();
         playout_count = 0;
+        full_search = config.full_search_prob >= 1.0F || full_search_distribution(random_engine);
+        current_playout_limit = full_search ? config.playout_limit : config.fast_playout_limit;
+        TreeNode *existing_root = config.reuse_tree ? MCTSBase::find_existing_root(tree_table.get(), root_node, root_board, board) : nullptr;
+        root_board = board;
+        // 一手詰めで終端とされたノードは、make_rootで改めて詰みの手を求める
+        if (existing_root && !existing_root->terminal())
+        {
+            // 部分木だけを予備のテーブルに詰めてコピーし、テーブルを入れ替える。テーブルのサイズは1手当たりのプレイアウト数+αのまま済む。
+            spare_table->clear();
+            root_node = MCTSBase::copy_subtree(tree_table.get(), existing_root, spare_table.get());
+            swap(tree_table, spare_table);
+            playout_count = MCTSBase::visit_sum(root_node);
+            // 子ノードだった時点ではノイズは加えられていないので、事前確率をそのまま元の値とする
+            memcpy(root_prior, root_node->value_p, sizeof(root_prior));
+            add_root_noise();
+            next_task = NextTask::SEARCH_TREE;
+            return SearchPartialResult::none();
+        }
+        tree_table->clear();
         return make_root(board);
     }
 
-    shared_ptr<SearchPartialResult> make_root(const Board &b)
+    SearchPartialResult make_root(const Board &b)
     {
-        // 学習時は探索木の再利用をしない。ルートにディレクレノイズを足した状態で探索する必要があるため、ノイズが足されていない子ノードをルートとして再利用すると結果が変化する。
         bool mate_found;
         Move mate_move;
         root_node = MCTSBase::make_node(b, tree_table.get(), config.mate_1ply, mate_found, mate_move);
@@ -157,19 +247,17 @@ private:
         {
             // 詰みの手が見つかったのでそれを指して終わり
             next_task = NextTask::START_SEARCH;
-            auto result = new SearchPartialResultMove();
-            result->move = mate_move;
-            result->score = 1.0F;
-            return shared_ptr<SearchPartialResult>(result);
+            return SearchPartialResult::make_move(mate_move, 1.0F);
         }
         if (!root_node->terminal())
         {
             // 評価が必要
-            SearchPartialResultEvalRequest *req = new SearchPartialResultEvalRequest();
-            req->board.set(b);
-            req->leaf = root_node;
+            request_boards[0] = b;
+            request_leaves[0] = root_node;
+            request_paths[0].clear();
+            n_requests = 1;
             next_task = NextTask::ASSIGN_ROOT_EVAL;
-            return shared_ptr<SearchPartialResult>(req);
+            return SearchPartialResult::eval_request(n_requests);
         }
         else
         {
@@ -179,125 +267,121 @@ private:
         }
     }
 
-    vector<float> make_dirichret(size_t size)
+    void make_dirichret(float *d, int size)
     {
-        vector<float> d(size);
         float sum = 0.0F;
-        for (size_t i = 0; i < size; i++)
+        for (int i = 0; i < size; i++)
         {
             float r = gamma_distribution_for_dirichret(random_engine);
             sum += r;
             d[i] = r;
         }
-        for (size_t i = 0; i < size; i++)
+        for (int i = 0; i < size; i++)
         {
             d[i] /= sum;
         }
-
-        return d;
     }
 
-    shared_ptr<SearchPartialResult> assign_root_eval(const EvalResult *eval_result)
+    // ルートノードの事前確率を、元の値root_priorにディリクレノイズを加算したものにする。軽い探索では、指し手の質を優先してノイズを加えない。
+    void add_root_noise()
     {
-        assert(eval_result);
-        assert(prev_request);
-        auto leaf = prev_request->leaf;
-        assign_eval_result_to_leaf(leaf, eval_result);
-
-        // ルートノードにディリクレノイズを加算。
-        if (config.root_noise_epsilon > 0.0F)
+        if (full_search && config.root_noise_epsilon > 0.0F)
         {
-            auto dirichret = make_dirichret(prev_request->leaf->n_legal_moves);
-            auto value_p = prev_request->leaf->value_p;
-            for (int i = 0; i < prev_request->leaf->n_legal_moves; i++)
+            float dirichret[MAX_LEGAL_MOVES];
+            make_dirichret(dirichret, root_node->n_legal_moves);
+            auto value_p = root_node->value_p;
+            for (int i = 0; i < root_node->n_legal_moves; i++)
             {
-                value_p[i] = (1.0F - config.root_noise_epsilon) * value_p[i] + config.root_noise_epsilon * dirichret[i];
+                value_p[i] = (1.0F - config.root_noise_epsilon) * root_prior[i] + config.root_noise_epsilon * dirichret[i];
             }
         }
-
-        next_task = NextTask::SEARCH_TREE;
-        prev_request = nullptr;
-        return nullptr;
     }
 
-    shared_ptr<SearchPartialResult> assign_leaf_eval(const EvalResult *eval_result)
+    SearchPartialResult assign_root_eval(const EvalResult *eval_result)
     {
         assert(eval_result);
-        assert(prev_request);
-        auto leaf = prev_request->leaf;
-        assign_eval_result_to_leaf(leaf, eval_result);
-        backup_path(prev_request->tree_path, leaf->score);
-        prev_request = nullptr;
+        assert(n_requests == 1);
+        auto leaf = request_leaves[0];
+        MCTSBase::assign_eval_result(leaf, eval_result->policy_logits, eval_result->value_logit);
+        memcpy(root_prior, leaf->value_p, sizeof(root_prior));
+        add_root_noise();
+
         next_task = NextTask::SEARCH_TREE;
-        return nullptr;
+        n_requests = 0;
+        return SearchPartialResult::none();
     }
 
-    float assign_eval_result_to_leaf(TreeNode *leaf, const EvalResult *eval_result)
+    SearchPartialResult assign_leaf_eval(const EvalResult *eval_result)
     {
-        leaf->score = tanh(eval_result->value_logit);
-        assert(leaf->n_legal_moves);
-        // 合法手のみでsoftmaxを計算
-        float max_logit = -1000.0F;
-        for (int i = 0; i < leaf->n_legal_moves; i++)
+        assert(eval_result);
+        assert(n_requests > 0);
+        for (int i = 0; i < n_requests; i++)
         {
-            Move m = leaf->move_list[i];
-            float logit = eval_result->policy_logits[m];
-            if (max_logit < logit)
+            auto leaf = request_leaves[i];
+            auto &path = request_paths[i];
+            if (config.max_pending_requests > 1)
             {
-                max_logit = logit;
+                MCTSBase::apply_virtual_loss(path, config.virtual_loss, -1.0F);
             }
+            MCTSBase::assign_eval_result(leaf, eval_result[i].policy_logits, eval_result[i].value_logit);
+            leaf->pending = 0;
+            MCTSBase::backup_path(path, leaf);
         }
-        float expsum = 0.0F;
-        for (int i = 0; i < leaf->n_legal_moves; i++)
-        {
-            Move m = leaf->move_list[i];
-            float logit = eval_result->policy_logits[m];
-            float explogit = exp(logit - max_logit);
-            expsum += explogit;
-            leaf->value_p[i] = explogit;
-        }
-        for (int i = 0; i < leaf->n_legal_moves; i++)
-        {
-            leaf->value_p[i] /= expsum;
-        }
-
-        return leaf->score;
+        n_requests = 0;
+        next_task = NextTask::SEARCH_TREE;
+        return SearchPartialResult::none();
     }
 
-    shared_ptr<SearchPartialResult> search_tree()
+    SearchPartialResult search_tree()
     {
-        if (playout_count >= config.playout_limit)
+        // 評価要求がmax_pending_requests個たまるか、評価待ちのノードに到達するまでプレイアウトを繰り返す
+        while (n_requests < config.max_pending_requests)
         {
-            // playoutは終わり。指し手を決定する。
-            next_task = NextTask::CHOOSE_MOVE;
-            return nullptr;
+            if (playout_count >= current_playout_limit || root_node->solved())
+            {
+                break;
+            }
+            playout_count++;
+            auto &path = request_paths[n_requests];
+            path.clear();
+            PlayoutResult playout_result = search_recursive(board, root_node, path);
+            if (playout_result == PLAYOUT_COLLISION)
+            {
+                // このプレイアウトは、評価結果を受け取った後でやり直す
+                MCTSBase::revert_visits(path);
+                playout_count--;
+                break;
+            }
+            if (playout_result == PLAYOUT_EVAL)
+            {
+                if (config.max_pending_requests > 1)
+                {
+                    MCTSBase::apply_virtual_loss(path, config.virtual_loss, 1.0F);
+                }
+                n_requests++;
+            }
         }
 
-        playout_count++;
-        auto result = search_root();
-        if (result)
+        if (n_requests > 0)
         {
             next_task = NextTask::ASSIGN_LEAF_EVAL;
+            return SearchPartialResult::eval_request(n_requests);
         }
-        else
-        {
-            next_task = NextTask::SEARCH_TREE;
-        }
-        return result;
-    }
-
-    shared_ptr<SearchPartialResult> search_root()
-    {
-        vector<pair<TreeNode *, int>> path;
-        return search_recursive(board, root_node, path);
+        // playoutは終わり(または勝敗が証明された)。指し手を決定する。
+        next_task = NextTask::CHOOSE_MOVE;
+        return SearchPartialResult::none();
     }
 
-    shared_ptr<SearchPartialResult> search_recursive(Board &b, TreeNode *node, vector<pair<TreeNode *, int>> &path)
+    PlayoutResult search_recursive(Board &b, TreeNode *node, vector<pair<TreeNode *, int>> &path)
     {
-        if (node->terminal())
+        if (node->terminal() || node->solved())
         {
-            backup_path(path, node->score);
-            return nullptr;
+            MCTSBase::backup_path(path, node);
+            return PLAYOUT_DONE;
+        }
+        if (node->pending)
+        {
+            return PLAYOUT_COLLISION;
         }
 
         int edge = MCTSBase::select_edge(node, config.c_puct);
@@ -305,8 +389,8 @@ private:
         b.do_move(static_cast<Move>(node->move_list[edge]), undo_info);
         path.push_back({node, edge});
         int child_node_idx = node->children[edge];
-        node->value_n[edge]++;
-        shared_ptr<SearchPartialResult> result;
+        node->visit(edge);
+        PlayoutResult result = PLAYOUT_DONE;
         if (child_node_idx)
         {
             result = search_recursive(b, tree_table->at(child_node_idx), path);
@@ -320,17 +404,16 @@ private:
             node->children[edge] = tree_table->get_index(child_node);
             if (!child_node->terminal())
             {
-                // この場でバックアップできず、局面評価が必要
-                SearchPartialResultEvalRequest *req = new SearchPartialResultEvalRequest();
-                req->board.set(b);
-                req->leaf = child_node;
-                req->tree_path = path;
-                result = shared_ptr<SearchPartialResult>(req);
+                // この場でバックアップできず、局面評価が必要。経路はpathに残る。
+                child_node->pending = 1;
+                request_boards[n_requests] = b;
+                request_leaves[n_requests] = child_node;
+                result = PLAYOUT_EVAL;
             }
             else
             {
                 // 終局または詰みが見つかった場合
-                backup_path(path, child_node->score);
+                MCTSBase::backup_path(path, child_node);
             }
         }
 
@@ -338,38 +421,42 @@ private:
         return result;
     }
 
-    void backup_path(const vector<pair<TreeNode *, int>> &path, float leaf_score)
-    {
-        float score = leaf_score;
-        for (int i = int(path.size()) - 1; i >= 0; i--)
-        {
-            score = -score;
-            path[i].first->value_w[path[i].second] += score;
-        }
-    }
-
-    shared_ptr<SearchPartialResult> choose_move()
+    SearchPartialResult choose_move()
     {
         Move move = MOVE_PASS;
         float score = 0.0F;
         if (!root_node->terminal()) // terminalの場合はそもそもsearchが呼ばれないはず
         {
             int best_idx = 0;
-            if (board.piece_sum() <= config.select_move_proportional_until_move)
+            int proven_edge = MCTSBase::proven_best_edge(root_node);
+            // 負けが証明された指し手は、すべての指し手が負けの場合を除き選ばない
+            auto excluded = [this](int i)
+            { return root_node->edge_proven[i] == PROVEN_LOSS && root_node->proven != PROVEN_LOSS; };
+            int v_sum = 0;
+            for (int i = 0; i < root_node->n_legal_moves; i++)
             {
-                // 訪問回数に比例
-                int v_sum = 0;
-                for (int i = 0; i < root_node->n_legal_moves; i++)
+                if (!excluded(i))
                 {
-                    int value_n = root_node->value_n[i];
-                    v_sum += value_n;
+                    v_sum += root_node->value_n[i];
                 }
-
+            }
+            if (proven_edge >= 0)
+            {
+                // 勝ち(または引き分け)が証明された指し手
+                best_idx = proven_edge;
+            }
+            else if (board.piece_sum() <= config.select_move_proportional_until_move && v_sum > 0)
+            {
+                // 訪問回数に比例
                 uniform_int_distribution<int> dist(0, v_sum-1);
                 int ctr = dist(random_engine);
 
                 for (int i = 0; i < root_node->n_legal_moves; i++)
                 {
+                    if (excluded(i))
+                    {
+                        continue;
+                    }
                     int value_n = root_node->value_n[i];
                     if (ctr < value_n)
                     {
@@ -385,6 +472,10 @@ private:
                 int best_n = -1;
                 for (int i = 0; i < root_node->n_legal_moves; i++)
                 {
+                    if (excluded(i))
+                    {
+                        continue;
+                    }
                     int value_n = root_node->value_n[i];
                     if (best_n < value_n)
                     {
@@ -399,10 +490,7 @@ private:
         }
 
         next_task = NextTask::START_SEARCH;
-        auto result = new SearchPartialResultMove();
-        result->move = move;
-        result->score = score;
-        return shared_ptr<SearchPartialResult>(result);
+        return SearchPartialResult::make_move(move, score);
     }
 };
 
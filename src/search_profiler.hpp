@@ -0,0 +1,143 @@
+#ifndef _SEARCH_PROFILER_
+#define _SEARCH_PROFILER_
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// 探索の各処理(選択・展開・評価・バックアップ)にかかった時間などを計測する。
+// -DMCTS_PROFILE でビルドした場合のみ計測コードが有効になり、それ以外ではPROFILE_*マクロは何も生成しない。
+class SearchProfiler
+{
+public:
+    enum Phase
+    {
+        PHASE_SELECT,   // 子ノード選択(select_edge)
+        PHASE_EXPAND,   // ノード生成(make_node)
+        PHASE_EVALUATE, // DNN評価
+        PHASE_SOLVE,    // 末端の完全読み
+        PHASE_BACKUP,   // バックアップ
+        N_PHASES,
+    };
+
+    static const int n_latency_buckets = 24; // 評価時間のヒストグラム。i番目のビンは[2^i, 2^(i+1))サイクル。
+
+    long long phase_count[N_PHASES];
+    unsigned long long phase_cycles[N_PHASES];
+    long long eval_latency_hist[n_latency_buckets];
+    int playouts;
+    int depth_max;
+    long long depth_sum;
+    long long root_reuse_hits, root_reuse_queries; // 複数手にわたって累積する
+    unsigned long long start_cycles;
+    chrono::steady_clock::time_point start_time;
+
+    SearchProfiler() : root_reuse_hits(0), root_reuse_queries(0)
+    {
+        reset();
+    }
+
+    static unsigned long long now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // 1手分の計測を開始する
+    void reset()
+    {
+        for (int i = 0; i < N_PHASES; i++)
+        {
+            phase_count[i] = 0;
+            phase_cycles[i] = 0;
+        }
+        for (int i = 0; i < n_latency_buckets; i++)
+        {
+            eval_latency_hist[i] = 0;
+        }
+        playouts = 0;
+        depth_max = 0;
+        depth_sum = 0;
+        start_cycles = now();
+        start_time = chrono::steady_clock::now();
+    }
+
+    void add_time(Phase phase, unsigned long long begin_cycles)
+    {
+        unsigned long long cycles = now() - begin_cycles;
+        phase_count[phase]++;
+        phase_cycles[phase] += cycles;
+        if (phase == PHASE_EVALUATE)
+        {
+            int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+            eval_latency_hist[min(bucket, n_latency_buckets - 1)]++;
+        }
+    }
+
+    void add_playout(int depth)
+    {
+        playouts++;
+        depth_sum += depth;
+        depth_max = max(depth_max, depth);
+    }
+
+    void add_root_query(bool reused)
+    {
+        root_reuse_queries++;
+        if (reused)
+        {
+            root_reuse_hits++;
+        }
+    }
+
+    // reset()からの計測結果をJSON(1行)で返す
+    string to_json(int piece_sum, size_t table_used, size_t table_size) const
+    {
+        static const char *phase_names[N_PHASES] = {"select", "expand", "evaluate", "solve", "backup"};
+        double wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+        double cycles_per_ms = wall_ms > 0.0 ? (now() - start_cycles) / wall_ms : 0.0;
+        stringstream ss;
+        ss << "{\"piece_sum\":" << piece_sum
+           << ",\"wall_ms\":" << wall_ms
+           << ",\"cycles_per_ms\":" << static_cast<long long>(cycles_per_ms)
+           << ",\"playouts\":" << playouts
+           << ",\"phases\":{";
+        for (int i = 0; i < N_PHASES; i++)
+        {
+            ss << (i ? "," : "") << "\"" << phase_names[i] << "\":{\"count\":" << phase_count[i] << ",\"cycles\":" << phase_cycles[i] << "}";
+        }
+        ss << "},\"depth_max\":" << depth_max
+           << ",\"depth_avg\":" << (playouts ? static_cast<double>(depth_sum) / playouts : 0.0)
+           << ",\"nodes_allocated\":" << phase_count[PHASE_EXPAND]
+           << ",\"table_used\":" << table_used
+           << ",\"table_size\":" << table_size
+           << ",\"table_fill\":" << (table_size ? static_cast<double>(table_used) / table_size : 0.0)
+           << ",\"eval_latency_hist\":[";
+        for (int i = 0; i < n_latency_buckets; i++)
+        {
+            ss << (i ? "," : "") << eval_latency_hist[i];
+        }
+        ss << "],\"root_reuse\":{\"hits\":" << root_reuse_hits << ",\"queries\":" << root_reuse_queries << "}}";
+        return ss.str();
+    }
+};
+
+#ifdef MCTS_PROFILE
+#define PROFILE_BEGIN(var) unsigned long long var = SearchProfiler::now()
+#define PROFILE_END(profiler, phase, var) (profiler).add_time(SearchProfiler::phase, var)
+#define PROFILE_EXEC(stmt) stmt
+#else
+#define PROFILE_BEGIN(var)
+#define PROFILE_END(profiler, phase, var)
+#define PROFILE_EXEC(stmt)
+#endif
+
+#endif
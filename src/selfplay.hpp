@@ -0,0 +1,607 @@
+#ifndef _SELFPLAY_
+#define _SELFPLAY_
+// 自己対局による棋譜生成。Python拡張(lib_pybind11.cpp)とselfplay(main_selfplay.cpp)で共有する。
+#include <fstream>
+#include <deque>
+#include "search_mcts_train.hpp"
+#include "dnn_evaluator.hpp"
+#include "thread_pool.hpp"
+
+// 24bytes
+struct MoveRecord
+{
+    BoardPlane planes[N_PLAYER];
+    uint8_t turn;          // BLACK / WHITE
+    uint8_t move;          // 選んだ指し手
+    int8_t game_result;    // 終局時の石の数の差。手番側が多い(勝ち)で正、負けで負、引き分けは0
+    uint8_t n_legal_moves; // 合法手の数(0はパス)
+    uint8_t flags;         // RECORD_FLAG_*の組み合わせ
+    uint8_t pad[3];        // BoardPlaneのアライメント
+};
+
+// 指し手を軽い探索(playout cap randomization)で決めた。方策の教師には使わない。
+// 旧形式の棋譜ではpadだった領域なので、0が通常の探索となるようにする。
+const uint8_t RECORD_FLAG_FAST_SEARCH = 1;
+
+// 1回のproceedで評価を求める局面のバッチ。複数のゲーム(または同じゲームの複数の要求)で同じ局面があれば、1行にまとめる。
+// addは複数スレッドから呼んでよい。
+class PlayoutBatch
+{
+    mutex mtx;
+    int _capacity;
+    float *board_repr; // 評価を求めたい盤面表現を、このアドレスから詰めて書き込む
+    int n_filled;
+    vector<Board> boards;
+    vector<int> table;             // 局面のハッシュから行番号を引く表。-1は空き。
+    vector<size_t> table_position; // 行ごとの、tableにおける位置(クリア用)
+    size_t table_mask;
+
+public:
+    const float *policy_logits; // 前回のバッチの評価結果
+    const float *value_logit;   // 前回のバッチの評価結果
+
+    PlayoutBatch(int capacity) : _capacity(capacity), board_repr(nullptr), n_filled(0), boards(capacity), table_position(capacity), policy_logits(nullptr), value_logit(nullptr)
+    {
+        size_t table_size = 1;
+        while (table_size < size_t(capacity) * 2)
+        {
+            table_size *= 2;
+        }
+        table.assign(table_size, -1);
+        table_mask = table_size - 1;
+    }
+
+    void begin(float *board_repr, const float *policy_logits, const float *value_logit)
+    {
+        for (int i = 0; i < n_filled; i++)
+        {
+            table[table_position[i]] = -1;
+        }
+        n_filled = 0;
+        this->board_repr = board_repr;
+        this->policy_logits = policy_logits;
+        this->value_logit = value_logit;
+    }
+
+    // 局面をバッチに追加し、その行番号を返す。すでに同じ局面があれば、その行番号を返す。
+    int add(const Board &board)
+    {
+        int slot;
+        {
+            lock_guard<mutex> lock(mtx);
+            size_t pos = board.hash() & table_mask;
+            while (table[pos] >= 0)
+            {
+                if (boards[table[pos]] == board)
+                {
+                    return table[pos];
+                }
+                pos = (pos + 1) & table_mask;
+            }
+            if (n_filled >= _capacity)
+            {
+                throw runtime_error("PlayoutBatch: capacity exceeded");
+            }
+            slot = n_filled++;
+            table[pos] = slot;
+            table_position[slot] = pos;
+            boards[slot] = board;
+        }
+        // 行の書き込みは、行を確保したスレッドだけが行うのでロック不要
+        FeatureExtractor extractor;
+        DNNInputFeature feat = extractor.extract(board);
+        memcpy((char *)board_repr + sizeof(feat.board_repr) * slot, feat.board_repr, sizeof(feat.board_repr));
+        return slot;
+    }
+
+    int size() const
+    {
+        return n_filled;
+    }
+
+    int capacity() const
+    {
+        return _capacity;
+    }
+
+    // slot行目の局面
+    const Board &board(int slot) const
+    {
+        return boards[slot];
+    }
+};
+
+// DNN評価結果のキャッシュ機構。初手付近など並行するプレイ間での共有や、局面を進めた後に同じノードを評価する場面で高速化する。
+// 複数スレッドから使えるよう、エントリをn_shards個のグループに分け、グループごとにロックする。
+class EvalCache
+{
+    class CacheEntry
+    {
+    public:
+        Board board;
+        SearchMCTSTrain::EvalResult eval_result;
+
+        CacheEntry()
+        {
+            // 空のボードは、実現する盤面とマッチしない
+            memset(static_cast<void *>(&board), 0, sizeof(board));
+        }
+    };
+
+    static const int n_shards = 64;
+    size_t size;
+    size_t hash_mask;
+    vector<CacheEntry> cache;
+    mutex shard_mutex[n_shards];
+    atomic<long long> cache_hit, total_get;
+
+public:
+    EvalCache(size_t size) : size(size), hash_mask(size - 1), cache(size), cache_hit(0), total_get(0)
+    {
+        if (size & (size - 1))
+        {
+            throw runtime_error("EvalCache: size must be power of 2");
+        }
+    }
+
+    // キャッシュにあれば、評価結果をeval_resultにコピーしてtrueを返す
+    bool get(const Board &board, SearchMCTSTrain::EvalResult &eval_result)
+    {
+        total_get++;
+        size_t key = board.hash() & hash_mask;
+        lock_guard<mutex> lock(shard_mutex[key % n_shards]);
+        CacheEntry *entry = &cache[key];
+        if (entry->board == board)
+        {
+            cache_hit++;
+            memcpy(&eval_result, &entry->eval_result, sizeof(eval_result));
+            return true;
+        }
+        return false;
+    }
+
+    void put(const Board &board, const SearchMCTSTrain::EvalResult *eval_result)
+    {
+        size_t key = board.hash() & hash_mask;
+        lock_guard<mutex> lock(shard_mutex[key % n_shards]);
+        CacheEntry *entry = &cache[key];
+        entry->board = board;
+        memcpy(&entry->eval_result, eval_result, sizeof(*eval_result));
+    }
+};
+
+// 棋譜の書き込みを専用スレッドで行う。複数のゲームから同時にpushしてよい。
+class RecordWriter
+{
+    shared_ptr<ofstream> fout;
+    mutex mtx;
+    condition_variable cv;
+    deque<vector<MoveRecord>> queue;
+    bool quit;
+    thread writer_thread;
+
+public:
+    RecordWriter(shared_ptr<ofstream> fout) : fout(fout), quit(false), writer_thread(&RecordWriter::writer_loop, this)
+    {
+    }
+
+    // キューに残っている棋譜をすべて書き込んでから終了する
+    ~RecordWriter()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            quit = true;
+        }
+        cv.notify_one();
+        writer_thread.join();
+        fout->flush();
+    }
+
+    // 1ゲーム分の棋譜を書き込み待ちにする
+    void push(vector<MoveRecord> &&records)
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            queue.push_back(move(records));
+        }
+        cv.notify_one();
+    }
+
+private:
+    void writer_loop()
+    {
+        while (true)
+        {
+            vector<MoveRecord> records;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [this]
+                        { return quit || !queue.empty(); });
+                if (queue.empty())
+                {
+                    return;
+                }
+                records = move(queue.front());
+                queue.pop_front();
+            }
+            fout->write((char *)&records[0], records.size() * sizeof(MoveRecord));
+        }
+    }
+};
+
+class SinglePlayout
+{
+    Board board;
+    int n_evaluating;                                 // 評価結果を待っている要求の数
+    vector<Board> evaluating_boards;                  // 評価結果を待っている局面
+    vector<int> evaluating_slots;                     // 評価結果が入るバッチの行。キャッシュから得た場合は-1。
+    vector<SearchMCTSTrain::EvalResult> eval_results; // engineに渡す評価結果
+    vector<MoveRecord> records;
+    shared_ptr<EvalCache> eval_cache;
+    atomic_int _games_completed; // 探索中に別スレッドから読まれる
+
+public:
+    shared_ptr<RecordWriter> record_writer;
+    SearchMCTSTrain engine;
+
+    SinglePlayout(shared_ptr<RecordWriter> record_writer, SearchMCTSTrain::SearchMCTSConfig mcts_config, shared_ptr<EvalCache> eval_cache)
+        : n_evaluating(0), evaluating_boards(mcts_config.max_pending_requests), evaluating_slots(mcts_config.max_pending_requests), eval_results(mcts_config.max_pending_requests),
+          eval_cache(eval_cache), _games_completed(0), record_writer(record_writer), engine(mcts_config)
+    {
+        board.set_hirate();
+        engine.board.set(board);
+        records.reserve(BOARD_AREA * 2); // 1ゲーム分。パスを含めても超えない。
+    }
+
+    int games_completed() const
+    {
+        return _games_completed;
+    }
+
+    // 前回のバッチの評価結果を受け取り、次に評価が必要な局面をバッチに追加するまで進める
+    void proceed(PlayoutBatch &batch)
+    {
+        for (int i = 0; i < n_evaluating; i++)
+        {
+            int slot = evaluating_slots[i];
+            if (slot >= 0)
+            {
+                memcpy(eval_results[i].policy_logits, batch.policy_logits + slot * BOARD_AREA, sizeof(eval_results[i].policy_logits));
+                eval_results[i].value_logit = batch.value_logit[slot];
+                eval_cache->put(evaluating_boards[i], &eval_results[i]);
+            }
+        }
+        n_evaluating = 0;
+        while (true)
+        {
+            auto search_partial_result = engine.search_partial(&eval_results[0]);
+            if (search_partial_result.type == SearchMCTSTrain::SearchPartialResult::MOVE)
+            {
+                // 指し手を進める
+                proceed_game(search_partial_result.move, engine.is_full_search() ? 0 : RECORD_FLAG_FAST_SEARCH);
+                continue;
+            }
+
+            // 評価が必要。キャッシュになければバッチに追加する。
+            bool need_batch = false;
+            for (int i = 0; i < search_partial_result.n_requests; i++)
+            {
+                const Board &request_board = engine.request_board(i);
+                evaluating_boards[i] = request_board;
+                if (eval_cache->get(request_board, eval_results[i]))
+                {
+                    evaluating_slots[i] = -1;
+                }
+                else
+                {
+                    evaluating_slots[i] = batch.add(request_board);
+                    need_batch = true;
+                }
+            }
+            if (need_batch)
+            {
+                n_evaluating = search_partial_result.n_requests;
+                return;
+            }
+        }
+    }
+
+private:
+    void do_move_with_record(Move move, uint8_t flags)
+    {
+        // boardを進めるとともに指し手を記録
+        BoardPlane lm;
+        board.legal_moves_bb(lm);
+        auto n_legal_moves = __builtin_popcountll(lm);
+        MoveRecord record;
+        record.move = static_cast<decltype(record.move)>(move);
+        record.planes[0] = board.plane(0);
+        record.planes[1] = board.plane(1);
+        record.turn = static_cast<decltype(record.turn)>(board.turn());
+        record.n_legal_moves = static_cast<decltype(record.turn)>(n_legal_moves);
+        record.flags = flags;
+        memset(record.pad, 0, sizeof(record.pad));
+
+        records.push_back(record);
+
+        UndoInfo undo_info;
+        board.do_move(move, undo_info);
+    }
+
+    void flush_record_with_game_result()
+    {
+        // gameoverの時に呼び出す。recordsにゲームの結果を書きこんだうえでファイルに出力する。
+
+        int8_t stone_diff_black = static_cast<int8_t>(board.piece_num(BLACK) - board.piece_num(WHITE));
+        for (auto &record : records)
+        {
+            record.game_result = record.turn == BLACK ? stone_diff_black : -stone_diff_black;
+        }
+
+        record_writer->push(move(records));
+        records.clear();
+        records.reserve(BOARD_AREA * 2);
+        _games_completed++;
+    }
+
+    void proceed_game(Move move, uint8_t flags)
+    {
+        // 指定された指し手でゲームを進め、次に指し手選択が必要な状態まで進行する。最新の局面をengineにセットする。
+        do_move_with_record(move, flags);
+
+        while (true)
+        {
+            if (board.is_gameover())
+            {
+                flush_record_with_game_result();
+                board.set_hirate();
+                engine.newgame();
+                engine.board.set(board);
+            }
+
+            BoardPlane lm;
+            board.legal_moves_bb(lm);
+            if (!lm)
+            {
+                do_move_with_record(MOVE_PASS, 0);
+            }
+            else if (!(lm & (lm - 1)))
+            {
+                // 合法手が1つだけ
+                do_move_with_record(static_cast<Move>(__builtin_ctzll(lm)), 0);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        engine.board.set(board);
+        return;
+    }
+};
+
+// ゲームをn_groups個のグループに分けて進める。グループごとにバッチを持ち、
+// あるグループの評価(Python側)と、別のグループの探索(C++側)を同時に行える(submit/collect)。
+class ParallelPlayout
+{
+    class PlayoutGroup
+    {
+    public:
+        enum State
+        {
+            IDLE,      // 探索していない。collect済み。
+            SUBMITTED, // 探索待ちまたは探索中
+            DONE,      // 探索が終わり、collect待ち
+        };
+        int game_begin, game_end; // このグループが担当するゲームの範囲
+        unique_ptr<PlayoutBatch> batch;
+        State state;
+        float *board_repr;
+        const float *policy_logits;
+        const float *value_logit;
+        int n_filled;
+        exception_ptr error;
+    };
+
+public:
+    shared_ptr<RecordWriter> record_writer;
+    vector<unique_ptr<SinglePlayout>> single_playouts;
+    shared_ptr<EvalCache> eval_cache;
+    int parallel;
+
+private:
+    vector<PlayoutGroup> groups;
+    ThreadPool thread_pool;
+    // submitされたグループを順に探索するスレッド
+    mutex async_mutex;
+    condition_variable async_cv;
+    deque<int> submitted_groups;
+    bool quit;
+    thread async_thread;
+
+public:
+    // n_threads: ゲームを進めるスレッド数(呼び出し元を含む)
+    ParallelPlayout(shared_ptr<ofstream> fout, SearchMCTSTrain::SearchMCTSConfig mcts_config, int parallel, int n_threads, int n_groups)
+        : record_writer(new RecordWriter(fout)), eval_cache(new EvalCache(1024 * 1024)), parallel(parallel), groups(n_groups), thread_pool(n_threads), quit(false)
+    {
+        if (n_groups < 1 || n_groups > parallel)
+        {
+            throw runtime_error("ParallelPlayout: n_groups must be in [1, parallel]");
+        }
+        for (int i = 0; i < parallel; i++)
+        {
+            single_playouts.push_back(unique_ptr<SinglePlayout>(new SinglePlayout(record_writer, mcts_config, eval_cache)));
+        }
+        for (int g = 0; g < n_groups; g++)
+        {
+            PlayoutGroup &group = groups[g];
+            group.game_begin = parallel * g / n_groups;
+            group.game_end = parallel * (g + 1) / n_groups;
+            group.batch.reset(new PlayoutBatch((group.game_end - group.game_begin) * mcts_config.max_pending_requests));
+            group.state = PlayoutGroup::IDLE;
+            group.n_filled = 0;
+        }
+        async_thread = thread(&ParallelPlayout::async_loop, this);
+    }
+
+    ~ParallelPlayout()
+    {
+        {
+            lock_guard<mutex> lock(async_mutex);
+            quit = true;
+        }
+        async_cv.notify_all();
+        async_thread.join();
+    }
+
+    int games_completed() const
+    {
+        int sum = 0;
+        for (int i = 0; i < parallel; i++)
+        {
+            sum += single_playouts[i]->games_completed();
+        }
+        return sum;
+    }
+
+    // グループのバッチの行数の上限
+    int group_capacity(int group) const
+    {
+        return groups.at(group).batch->capacity();
+    }
+
+    // 直前のproceedで、グループのバッチのslot行目に書き込んだ局面
+    const Board &batch_board(int group, int slot) const
+    {
+        return groups.at(group).batch->board(slot);
+    }
+
+    ThreadPool &get_thread_pool()
+    {
+        return thread_pool;
+    }
+
+    // batch_policy_logits, batch_value_logitは、前回のproceedで書き込まれた局面の評価結果。
+    // 評価を求める局面をbatch_board_reprの先頭から詰めて書き込み、その数を返す。
+    // submitしたグループの探索中に呼んだ場合、スレッドプールはその探索の後に使われる。
+    int proceed(int group, float *batch_board_repr, const float *batch_policy_logits, const float *batch_value_logit)
+    {
+        PlayoutGroup &g = groups.at(group);
+        {
+            lock_guard<mutex> lock(async_mutex);
+            if (g.state != PlayoutGroup::IDLE)
+            {
+                throw runtime_error("ParallelPlayout: group is being searched");
+            }
+        }
+        return proceed_group(g, batch_board_repr, batch_policy_logits, batch_value_logit);
+    }
+
+    // proceedをバックグラウンドで開始する。結果はcollectで受け取る。それまで配列を書き換えてはならない。
+    void submit(int group, float *batch_board_repr, const float *batch_policy_logits, const float *batch_value_logit)
+    {
+        lock_guard<mutex> lock(async_mutex);
+        PlayoutGroup &g = groups.at(group);
+        if (g.state != PlayoutGroup::IDLE)
+        {
+            throw runtime_error("ParallelPlayout: group is already submitted");
+        }
+        g.state = PlayoutGroup::SUBMITTED;
+        g.board_repr = batch_board_repr;
+        g.policy_logits = batch_policy_logits;
+        g.value_logit = batch_value_logit;
+        g.error = nullptr;
+        submitted_groups.push_back(group);
+        async_cv.notify_all();
+    }
+
+    // submitしたグループの探索が終わるまで待ち、評価を求める局面の数を返す
+    int collect(int group)
+    {
+        unique_lock<mutex> lock(async_mutex);
+        PlayoutGroup &g = groups.at(group);
+        if (g.state == PlayoutGroup::IDLE)
+        {
+            throw runtime_error("ParallelPlayout: group is not submitted");
+        }
+        async_cv.wait(lock, [&g]
+                      { return g.state == PlayoutGroup::DONE; });
+        g.state = PlayoutGroup::IDLE;
+        if (g.error)
+        {
+            rethrow_exception(g.error);
+        }
+        return g.n_filled;
+    }
+
+private:
+    int proceed_group(PlayoutGroup &g, float *batch_board_repr, const float *batch_policy_logits, const float *batch_value_logit)
+    {
+        PlayoutBatch &batch = *g.batch;
+        batch.begin(batch_board_repr, batch_policy_logits, batch_value_logit);
+        // 各ゲームは互いに独立で、共有するのはbatch, eval_cache, record_writerのみ(いずれもスレッドセーフ)
+        // キャプチャを2つに抑え、std::functionがヒープ確保せずに保持できるようにする
+        thread_pool.parallel_for(g.game_end - g.game_begin, [this, &g](int i)
+                                 { single_playouts[g.game_begin + i]->proceed(*g.batch); });
+        return batch.size();
+    }
+
+    void async_loop()
+    {
+        while (true)
+        {
+            int group;
+            {
+                unique_lock<mutex> lock(async_mutex);
+                async_cv.wait(lock, [this]
+                              { return quit || !submitted_groups.empty(); });
+                if (quit)
+                {
+                    return;
+                }
+                group = submitted_groups.front();
+                submitted_groups.pop_front();
+            }
+            PlayoutGroup &g = groups[group];
+            int n_filled = 0;
+            exception_ptr error;
+            try
+            {
+                n_filled = proceed_group(g, g.board_repr, g.policy_logits, g.value_logit);
+            }
+            catch (...)
+            {
+                error = current_exception();
+            }
+            {
+                lock_guard<mutex> lock(async_mutex);
+                g.n_filled = n_filled;
+                g.error = error;
+                g.state = PlayoutGroup::DONE;
+            }
+            async_cv.notify_all();
+        }
+    }
+};
+
+// 自己対局用の探索設定。full_search_prob<1の場合、その確率でplayout_limit回、それ以外はfast_playout_limit回探索する。
+SearchMCTSTrain::SearchMCTSConfig make_selfplay_mcts_config(int playout_limit, int pending_per_game, int fast_playout_limit, float full_search_prob)
+{
+    SearchMCTSTrain::SearchMCTSConfig mcts_config;
+    mcts_config.playout_limit = playout_limit;
+    mcts_config.fast_playout_limit = fast_playout_limit;
+    mcts_config.full_search_prob = full_search_prob;
+    // 再利用する部分木は1手ごとに予備のテーブルへ詰めてコピーし、その訪問回数もプレイアウト数に含めるので、プレイアウト数＋マージンでOK
+    mcts_config.table_size = max(playout_limit, fast_playout_limit) + 16;
+    mcts_config.c_puct = 1.0;
+    mcts_config.root_noise_dirichret_alpha = 1.6; // AlphaZeroで将棋の場合0.15。平均合法手数に反比例。将棋は80、オセロは（手元の実測で）7.5。
+    mcts_config.root_noise_epsilon = 0.25;
+    mcts_config.select_move_proportional_until_move = BOARD_AREA; // 常に訪問回数に比例
+    mcts_config.mate_1ply = true;
+    mcts_config.max_pending_requests = pending_per_game;
+    mcts_config.virtual_loss = 1.0;
+    mcts_config.reuse_tree = true;
+    return mcts_config;
+}
+#endif
@@ -0,0 +1,75 @@
+#ifndef _SIMD_UTIL_
+#define _SIMD_UTIL_
+
+// SIMD命令を使うための共通定義。
+// ビルド時のオプション(-mavx2など)に依存せず、関数単位でtarget属性を付けてAVX2命令を生成し、実行時にCPUの対応を確認して呼び分ける。
+// -DNO_SIMDでビルドすると、常にスカラー実装を用いる(比較・デバッグ用)。
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#define SIMD_X86
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+// AVX-VNNI(VEX符号化の8bit積和命令vpdpbusd)。AVX2の関数から呼ばれる補助関数は、TARGET_AVX2を付ければこちらにもインライン展開できる。
+#define TARGET_AVX_VNNI __attribute__((target("avx2,fma,avxvnni")))
+#endif
+
+// 実行中のCPUがAVX2とFMAに対応しているか
+inline bool cpu_has_avx2()
+{
+#ifdef SIMD_X86
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// 実行中のCPUがAVX-VNNIに対応しているか
+inline bool cpu_has_avx_vnni()
+{
+#ifdef SIMD_X86
+    static const bool supported = cpu_has_avx2() && __builtin_cpu_supports("avxvnni");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#ifdef SIMD_X86
+// expの近似(相対誤差1e-7程度)。2^n * exp(r), |r| <= ln2/2 に分解し、expを多項式で近似する。
+TARGET_AVX2 inline __m256 exp256_ps(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0F)), _mm256_set1_ps(88.0F));
+    __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504F)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375F), x);
+    r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4F), r);
+    __m256 p = _mm256_set1_ps(1.0F / 720.0F);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0F / 120.0F));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0F / 24.0F));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0F / 6.0F));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(0.5F));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0F));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0F));
+    __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+}
+
+// 8要素の最大値を全要素に入れて返す
+TARGET_AVX2 inline __m256 hmax256_ps(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_permute2f128_ps(x, x, 1));
+    x = _mm256_max_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm256_max_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return x;
+}
+
+// 8要素の合計を全要素に入れて返す
+TARGET_AVX2 inline __m256 hsum256_ps(__m256 x)
+{
+    x = _mm256_add_ps(x, _mm256_permute2f128_ps(x, x, 1));
+    x = _mm256_add_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm256_add_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return x;
+}
+#endif
+#endif
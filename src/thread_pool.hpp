@@ -0,0 +1,130 @@
+#ifndef _THREAD_POOL_
+#define _THREAD_POOL_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <vector>
+
+using namespace std;
+
+// 固定数のワーカースレッドで、0からn-1までの処理を分担して実行する。
+// 呼び出し元のスレッドも処理に参加する。処理ごとの負荷が異なっても偏らないよう、処理は早く空いたスレッドから順に取る。
+// 複数のスレッドから同時にparallel_forを呼んだ場合は、1つずつ順に実行する(処理の中から呼んではならない)。
+class ThreadPool
+{
+    vector<thread> workers;
+    mutex call_mtx; // parallel_forの実行中に保持する
+    mutex mtx;
+    condition_variable cv_start, cv_done;
+    const function<void(int)> *task;
+    int n_tasks;
+    atomic_int next_task;
+    int n_running;         // 処理中のワーカー数
+    long long generation;  // parallel_forの呼び出し回数。ワーカーが新しい処理の開始を検知するために使う。
+    bool quit;
+    exception_ptr error;   // 処理中に発生した例外(最初の1つ)
+
+public:
+    // n_threads: 呼び出し元を含むスレッド数
+    ThreadPool(int n_threads) : task(nullptr), n_tasks(0), next_task(0), n_running(0), generation(0), quit(false)
+    {
+        for (int i = 1; i < n_threads; i++)
+        {
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            quit = true;
+        }
+        cv_start.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int n_threads() const
+    {
+        return int(workers.size()) + 1;
+    }
+
+    // f(0), ..., f(n-1)を実行し、すべて終わるまで待つ。処理中の例外は呼び出し元で再送出する。
+    void parallel_for(int n, const function<void(int)> &f)
+    {
+        lock_guard<mutex> call_lock(call_mtx);
+        {
+            lock_guard<mutex> lock(mtx);
+            task = &f;
+            n_tasks = n;
+            next_task = 0;
+            n_running = int(workers.size());
+            error = nullptr;
+            generation++;
+        }
+        cv_start.notify_all();
+        run_tasks();
+        unique_lock<mutex> lock(mtx);
+        cv_done.wait(lock, [this]
+                     { return n_running == 0; });
+        if (error)
+        {
+            rethrow_exception(error);
+        }
+    }
+
+private:
+    void worker_loop()
+    {
+        long long seen_generation = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> lock(mtx);
+                cv_start.wait(lock, [this, seen_generation]
+                              { return quit || generation != seen_generation; });
+                if (quit)
+                {
+                    return;
+                }
+                seen_generation = generation;
+            }
+            run_tasks();
+            {
+                lock_guard<mutex> lock(mtx);
+                if (--n_running == 0)
+                {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+
+    void run_tasks()
+    {
+        int i;
+        while ((i = next_task.fetch_add(1)) < n_tasks)
+        {
+            try
+            {
+                (*task)(i);
+            }
+            catch (...)
+            {
+                lock_guard<mutex> lock(mtx);
+                if (!error)
+                {
+                    error = current_exception();
+                }
+            }
+        }
+    }
+};
+#endif
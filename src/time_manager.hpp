@@ -0,0 +1,170 @@
+#ifndef _TIME_MANAGER_
+#define _TIME_MANAGER_
+
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+// 探索エンジン共通の持ち時間管理。
+// 1手ごとに、ルール上の制限時間から「これを超えたら必ず打ち切る時間(hard)」と、
+// 空きマス数(局面の進行度)やゲーム全体の持ち時間から「探索が安定していれば打ち切る目安時間(soft)」を決める。
+// システム時刻の変更に影響されないよう、steady_clockを用いる。
+class TimeManager
+{
+public:
+    class TimeManagerConfig
+    {
+    public:
+        int turn_limit_ms;       // ルール上の1手あたりの制限時間[ms]
+        int first_turn_limit_ms; // ゲームの最初の手番の制限時間[ms]
+        int margin_ms;           // 通信遅延などに備えて制限時間から差し引く時間[ms]
+        int game_limit_ms;       // ゲーム全体の持ち時間[ms]。0ならゲーム全体の制限はなく、1手ごとの制限のみ。
+        float soft_ratio;        // 目安時間の、制限時間に対する割合。1.0以上なら常に制限時間まで探索する。
+        float max_extension;     // 探索が不安定な場合、目安時間をこの倍率まで延長する(制限時間は超えない)
+        // 目安時間より早く終わった手の余り時間を貯金し、以降の手で探索が不安定な場合の延長に使うか。
+        // 貯金は1手で使い切れる量(制限時間 - 目安時間 x max_extension)までとする。
+        // ゲーム全体の持ち時間がある場合は、余り時間は残りの手番に按分されるため使わない。
+        bool time_bank;
+    };
+
+private:
+    TimeManagerConfig config;
+    chrono::steady_clock::time_point turn_start_time;
+    double soft_ms, hard_ms;
+    double game_used_ms; // このゲームで使用した時間の合計
+    double bank_ms;      // 貯金した時間
+    int turn_count;      // このゲームで思考した手番の数
+
+public:
+    TimeManager(const TimeManagerConfig &config) : config(config), soft_ms(0.0), hard_ms(0.0), game_used_ms(0.0), bank_ms(0.0), turn_count(0)
+    {
+    }
+
+    void newgame()
+    {
+        game_used_ms = 0.0;
+        bank_ms = 0.0;
+        turn_count = 0;
+    }
+
+    // 手番の開始時に呼ぶ。emptiesは空きマス数。
+    void start_turn(int empties)
+    {
+        turn_start_time = chrono::steady_clock::now();
+        int limit_ms = turn_count == 0 ? config.first_turn_limit_ms : config.turn_limit_ms;
+        hard_ms = max(limit_ms - config.margin_ms, 1);
+        double base_ms = hard_ms * config.soft_ratio;
+        if (config.game_limit_ms > 0)
+        {
+            // 残りの持ち時間を、残りの自分の手番数で按分する
+            double remaining_ms = max(config.game_limit_ms - config.margin_ms - game_used_ms, 1.0);
+            int my_remaining_turns = max((empties + 1) / 2, 1);
+            hard_ms = min(hard_ms, remaining_ms);
+            base_ms = min(base_ms, remaining_ms / my_remaining_turns);
+        }
+        if (config.soft_ratio >= 1.0F && config.game_limit_ms <= 0)
+        {
+            soft_ms = hard_ms;
+        }
+        else
+        {
+            soft_ms = min(hard_ms, base_ms * phase_weight(empties));
+        }
+        // 制限時間の長い初手の貯金を持ち越さない
+        bank_ms = min(bank_ms, bank_capacity_ms());
+        turn_count++;
+    }
+
+    // 手番の終了時に呼ぶ。searched: 探索を行ったか。パスや合法手が1つの場合など、探索せずに指した手番の余り時間は貯金しない。
+    void end_turn(bool searched = true)
+    {
+        double elapsed = elapsed_ms();
+        game_used_ms += elapsed;
+        if (searched && config.time_bank && config.game_limit_ms <= 0)
+        {
+            // 目安時間との差を貯金に加える(延長した場合は引き出す)
+            bank_ms = min(max(bank_ms + soft_ms - elapsed, 0.0), bank_capacity_ms());
+        }
+    }
+
+    double elapsed_ms() const
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - turn_start_time).count();
+    }
+
+    double soft_limit_ms() const
+    {
+        return soft_ms;
+    }
+
+    double hard_limit_ms() const
+    {
+        return hard_ms;
+    }
+
+    double banked_ms() const
+    {
+        return bank_ms;
+    }
+
+    // この手番で、探索が不安定な場合に最大でどれだけ探索を続けられるか[ms]
+    double max_remaining_ms() const
+    {
+        return max(extension_limit_ms() - elapsed_ms(), 0.0);
+    }
+
+    // 制限時間を超えた。探索を直ちに打ち切る必要がある。
+    bool hard_timeout() const
+    {
+        return elapsed_ms() >= hard_ms;
+    }
+
+    // 探索を打ち切るべきか。stable: 最善手が変化しておらず、他の手との差が十分あるか。
+    // 目安時間を過ぎていて安定していれば打ち切る。不安定なら目安時間のmax_extension倍まで延長する。
+    bool should_stop(bool stable) const
+    {
+        double elapsed = elapsed_ms();
+        if (elapsed >= hard_ms)
+        {
+            return true;
+        }
+        if (elapsed < soft_ms)
+        {
+            return false;
+        }
+        return stable || elapsed >= extension_limit_ms();
+    }
+
+private:
+    // 貯金の上限。1手の探索は制限時間で打ち切られるため、それを超える貯金は使えない。
+    double bank_capacity_ms() const
+    {
+        return max(hard_ms - soft_ms * config.max_extension, 0.0);
+    }
+
+    double extension_limit_ms() const
+    {
+        double limit = soft_ms * config.max_extension;
+        if (config.time_bank)
+        {
+            limit += bank_ms;
+        }
+        return min(limit, hard_ms);
+    }
+
+    // 進行度に応じた時間配分の重み。序盤は定跡的で、終盤は完全読みが効くため、中盤に時間を使う。
+    static double phase_weight(int empties)
+    {
+        if (empties > 50)
+        {
+            return 0.6;
+        }
+        if (empties > 20)
+        {
+            return 1.2;
+        }
+        return 0.8;
+    }
+};
+#endif